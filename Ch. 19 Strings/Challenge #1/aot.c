@@ -0,0 +1,181 @@
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "aot.h"
+#include "debug.h"
+#include "object.h"
+
+/*
+  Ahead-of-time compiler: turns a compiled chunk into a standalone C program that does what run() would do with it.
+  Expressions have no jumps, so the stack depth before every instruction is known here, and each stack slot becomes a local
+  (s0, s1, ...). That lets the C compiler see through the whole chunk and optimize across instructions.
+  The output links against the normal runtime (every .c file except main.c and bench.c), for concatenate(), printValue() and friends.
+*/
+
+// Writes chars as a C string literal, escaping anything that isn't plain printable ASCII
+static void writeStringLiteral(FILE* file, const char* chars, int length) {
+    fputc('"', file);
+    for (int i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)chars[i];
+        if (c == '"' || c == '\\') {
+            fprintf(file, "\\%c", c);
+        } else if (c >= 32 && c < 127 && c != '?') { // '?' is escaped so trigraphs can't happen
+            fputc(c, file);
+        } else {
+            fprintf(file, "\\%03o", c);
+        }
+    }
+    fputc('"', file);
+}
+
+// Hex float literals are exact, so the generated program gets the same bits the compiler produced
+static void writeNumberLiteral(FILE* file, double number) {
+    if (isinf(number)) {
+        fprintf(file, number > 0 ? "HUGE_VAL" : "-HUGE_VAL");
+    } else if (isnan(number)) {
+        fprintf(file, "NAN");
+    } else {
+        fprintf(file, "%a", number);
+    }
+}
+
+// Writes the C expression for constant index. Strings were created up front in k<index>.
+static void writeConstant(FILE* file, Chunk* chunk, int index) {
+    Value value = chunk->constants.values[index];
+    if (IS_NUMBER(value)) {
+        fprintf(file, "NUMBER_VAL(");
+        writeNumberLiteral(file, AS_NUMBER(value));
+        fprintf(file, ")");
+    } else if (IS_OBJ(value)) {
+        fprintf(file, "k%d", index);
+    } else if (IS_BOOL(value)) {
+        fprintf(file, AS_BOOL(value) ? "BOOL_VAL(true)" : "BOOL_VAL(false)");
+    } else {
+        fprintf(file, "NIL_VAL");
+    }
+}
+
+static void writeBinary(FILE* file, int a, int b, int line, const char* wrap, const char* op) {
+    fprintf(file, "    if (!IS_NUMBER(s%d) || !IS_NUMBER(s%d)) fail(%d, \"Operands must be numbers.\");\n", a, b, line);
+    fprintf(file, "    s%d = %s(AS_NUMBER(s%d) %s AS_NUMBER(s%d));\n", a, wrap, a, op, b);
+}
+
+// Returns false if the chunk has something the C backend can't express (register machine code, for now)
+bool emitC(Chunk* chunk, const char* scriptName, FILE* file) {
+    // First pass: make sure every opcode is one we know, find how deep the stack gets, and whether anything can fail
+    int depth = 0;
+    int maxDepth = 0;
+    bool fallible = false;
+    for (int offset = 0; offset < chunk->count; offset++) {
+        switch (chunk->code[offset]) {
+            case OP_CONSTANT: offset++; // Fall through, it pushes like the literals
+            case OP_NIL:
+            case OP_TRUE:
+            case OP_FALSE:
+                depth++;
+                break;
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+                fallible = true; // Fall through, they pop like the rest
+            case OP_EQUAL:
+            case OP_RETURN:
+                depth--;
+                break;
+            case OP_NEGATE:
+                fallible = true;
+                break;
+            case OP_NOT:
+                break;
+            default:
+                return false;
+        }
+        if (depth > maxDepth) maxDepth = depth;
+    }
+
+    fprintf(file, "/*\n  Generated by clox --emit-c from %s.\n", scriptName);
+    fprintf(file, "  Build it against the runtime with \"make -C <clox dir> emitted EMITTED=<absolute path to this file>\",\n");
+    fprintf(file, "  or by hand with every .c in the clox dir except main.c and bench.c (and the same -D flags clox was built with).\n*/\n\n");
+    fprintf(file, "#include <math.h>\n#include <stdio.h>\n#include <stdlib.h>\n\n");
+    fprintf(file, "#include \"memory.h\"\n#include \"object.h\"\n#include \"value.h\"\n#include \"vm.h\"\n\n");
+
+    // Same output as runtimeError(), with the line baked in. Left out when nothing calls it, so the output builds without warnings.
+    if (fallible) {
+        fprintf(file, "static void fail(int line, const char* message) {\n");
+        fprintf(file, "    flushOutput(&vm.out);\n");
+        fprintf(file, "    fprintf(stderr, \"%%s\\n[line %%d] in script\\n\", message, line);\n");
+        fprintf(file, "    freeVM();\n    exit(70);\n}\n\n");
+    }
+
+    fprintf(file, "int main(void) {\n    initVM();\n\n");
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (!IS_STRING(value)) continue;
+        fprintf(file, "    Value k%d = OBJ_VAL(copyString(", i);
+        writeStringLiteral(file, AS_STRING(value)->chars, AS_STRING(value)->length);
+        fprintf(file, ", %d));\n", AS_STRING(value)->length);
+    }
+    for (int i = 0; i < maxDepth; i++) {
+        fprintf(file, "    Value s%d;\n", i);
+    }
+    fprintf(file, "\n");
+
+    // Second pass: one statement (or a few) per instruction, working on the slot locals
+    depth = 0;
+    for (int offset = 0; offset < chunk->count; offset++) {
+        uint8_t instruction = chunk->code[offset];
+        int line = chunk->lines[offset];
+        int top = depth - 1;
+        fprintf(file, "    // %04d %s (line %d)\n", offset, opcodeName(instruction), line);
+
+        switch (instruction) {
+            case OP_CONSTANT:
+                fprintf(file, "    s%d = ", depth);
+                writeConstant(file, chunk, chunk->code[++offset]);
+                fprintf(file, ";\n");
+                depth++;
+                break;
+            case OP_NIL:   fprintf(file, "    s%d = NIL_VAL;\n", depth++); break;
+            case OP_TRUE:  fprintf(file, "    s%d = BOOL_VAL(true);\n", depth++); break;
+            case OP_FALSE: fprintf(file, "    s%d = BOOL_VAL(false);\n", depth++); break;
+            case OP_EQUAL:
+                fprintf(file, "    s%d = BOOL_VAL(valuesEqual(s%d, s%d));\n", top - 1, top - 1, top);
+                depth--;
+                break;
+            case OP_GREATER:  writeBinary(file, top - 1, top, line, "BOOL_VAL", ">"); depth--; break;
+            case OP_LESS:     writeBinary(file, top - 1, top, line, "BOOL_VAL", "<"); depth--; break;
+            case OP_SUBTRACT: writeBinary(file, top - 1, top, line, "NUMBER_VAL", "-"); depth--; break;
+            case OP_MULTIPLY: writeBinary(file, top - 1, top, line, "NUMBER_VAL", "*"); depth--; break;
+            case OP_DIVIDE:   writeBinary(file, top - 1, top, line, "NUMBER_VAL", "/"); depth--; break;
+            case OP_ADD:
+                fprintf(file, "    if (IS_NUMBER(s%d) && IS_NUMBER(s%d)) {\n", top - 1, top);
+                fprintf(file, "        s%d = NUMBER_VAL(AS_NUMBER(s%d) + AS_NUMBER(s%d));\n", top - 1, top - 1, top);
+                fprintf(file, "    } else if (IS_STRING(s%d) && IS_STRING(s%d)) {\n", top - 1, top);
+                fprintf(file, "        s%d = OBJ_VAL(concatenate(AS_STRING(s%d), AS_STRING(s%d)));\n", top - 1, top - 1, top);
+                fprintf(file, "    } else {\n");
+                fprintf(file, "        fail(%d, \"Operands must be two numbers or two strings.\");\n", line);
+                fprintf(file, "    }\n");
+                depth--;
+                break;
+            case OP_NOT:
+                fprintf(file, "    s%d = BOOL_VAL(isFalsey(s%d));\n", top, top);
+                break;
+            case OP_NEGATE:
+                fprintf(file, "    if (!IS_NUMBER(s%d)) fail(%d, \"Operand must be a number.\");\n", top, line);
+                fprintf(file, "    s%d = NUMBER_VAL(-AS_NUMBER(s%d));\n", top, top);
+                break;
+            case OP_RETURN:
+                fprintf(file, "    printValue(s%d);\n", top);
+                fprintf(file, "    writeOutput(&vm.out, \"\\n\", 1);\n");
+                depth--;
+                break;
+        }
+    }
+
+    fprintf(file, "\n    freeVM();\n    return 0;\n}\n");
+    return true;
+}
@@ -0,0 +1,10 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+
+#include <stdio.h>
+
+#include "chunk.h"
+
+bool emitC(Chunk* chunk, const char* scriptName, FILE* file);
+
+#endif
@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "batch.h"
+#include "compiler.h"
+#include "memory.h"
+#include "vm.h"
+
+/*
+  Columns only hold numbers, and everything else in a formula is a constant, so the type of every stack slot at every instruction
+  is the same for every row. compileFormula() works those types out once. If every instruction has a kernel for its types, the
+  chunk becomes a list of Steps that each run over BATCH_LANES rows at a time, which the C compiler turns into vector code.
+  Anything else (strings, or a type error) runs row by row through run(), so it means exactly what it would have in a script.
+*/
+
+#define MAX_THREADS 64
+
+static void addStep(Formula* formula, Kernel kernel, int index, double constant) {
+    formula->steps[formula->stepCount++] = (Step){kernel, index, constant};
+}
+
+// Translates the chunk into steps, or returns false if some instruction would need run()
+static bool planKernels(Formula* formula) {
+    Chunk* chunk = &formula->chunk;
+    LaneType types[STACK_MAX];
+    int depth = 0;
+    formula->steps = ALLOCATE(Step, chunk->count); // At most one step per instruction, and instructions are at least a byte
+    formula->stepCount = 0;
+    formula->maxDepth = 0;
+
+    for (int offset = 0; offset < chunk->count; offset++) {
+        if (depth == STACK_MAX) return false; // run() couldn't either
+        uint8_t instruction = chunk->code[offset];
+        LaneType a = depth >= 2 ? types[depth - 2] : LANE_OTHER;
+        LaneType b = depth >= 1 ? types[depth - 1] : LANE_OTHER;
+        switch (instruction) {
+            case OP_CONSTANT: {
+                Value constant = chunk->constants.values[chunk->code[++offset]];
+                if (!IS_NUMBER(constant)) return false;
+                addStep(formula, KERNEL_PUSH, 0, AS_NUMBER(constant));
+                types[depth++] = LANE_NUMBER;
+                break;
+            }
+            case OP_NIL:   addStep(formula, KERNEL_PUSH, 0, 0); types[depth++] = LANE_NIL; break;
+            case OP_TRUE:  addStep(formula, KERNEL_PUSH, 0, 1); types[depth++] = LANE_BOOL; break;
+            case OP_FALSE: addStep(formula, KERNEL_PUSH, 0, 0); types[depth++] = LANE_BOOL; break;
+            case OP_INPUT:
+                addStep(formula, KERNEL_INPUT, chunk->code[++offset], 0);
+                types[depth++] = LANE_NUMBER;
+                break;
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_LESS:
+            case OP_GREATER: {
+                if (a != LANE_NUMBER || b != LANE_NUMBER) return false;
+                static const Kernel kernels[] = {
+                    [OP_ADD] = KERNEL_ADD, [OP_SUBTRACT] = KERNEL_SUBTRACT, [OP_MULTIPLY] = KERNEL_MULTIPLY,
+                    [OP_DIVIDE] = KERNEL_DIVIDE, [OP_LESS] = KERNEL_LESS, [OP_GREATER] = KERNEL_GREATER,
+                };
+                addStep(formula, kernels[instruction], 0, 0);
+                depth--;
+                types[depth - 1] = instruction == OP_LESS || instruction == OP_GREATER ? LANE_BOOL : LANE_NUMBER;
+                break;
+            }
+            case OP_EQUAL:
+                if (a == LANE_OTHER || b == LANE_OTHER) return false;
+                if (a != b) {
+                    addStep(formula, KERNEL_REPLACE, 2, 0); // Different types are never equal
+                } else if (a == LANE_NIL) {
+                    addStep(formula, KERNEL_REPLACE, 2, 1);
+                } else {
+                    addStep(formula, KERNEL_EQUAL, 0, 0); // Compares doubles, so NaN isn't equal to itself, same as valuesEqual()
+                }
+                depth--;
+                types[depth - 1] = LANE_BOOL;
+                break;
+            case OP_NOT:
+                if (b == LANE_OTHER) return false;
+                if (b == LANE_BOOL) {
+                    addStep(formula, KERNEL_NOT, 0, 0);
+                } else {
+                    addStep(formula, KERNEL_REPLACE, 1, b == LANE_NIL ? 1 : 0); // nil is falsey, every number is truthy
+                }
+                types[depth - 1] = LANE_BOOL;
+                break;
+            case OP_NEGATE:
+                if (b != LANE_NUMBER) return false;
+                addStep(formula, KERNEL_NEGATE, 0, 0);
+                break;
+            case OP_RETURN:
+                if (b == LANE_OTHER) return false;
+                addStep(formula, KERNEL_RETURN, 0, 0);
+                formula->resultType = b;
+                return true;
+            default:
+                return false;
+        }
+        if (depth > formula->maxDepth) formula->maxDepth = depth;
+    }
+    return false; // No OP_RETURN
+}
+
+// Compiles source with inputs[i] naming column i. Reports errors like interpret() does, and returns false on them.
+bool compileFormula(Formula* formula, const char* source, const char* inputs[], int inputCount) {
+    initChunk(&formula->chunk);
+    formula->inputCount = inputCount;
+    formula->vectorized = false;
+    formula->steps = NULL;
+    formula->stepCount = 0;
+    formula->maxDepth = 0;
+    formula->resultType = LANE_OTHER;
+
+    bool registerMachine = vm.registerMachine; // Kernels and runRow() both need stack code
+    vm.registerMachine = false;
+    bool compiled = inputCount <= UINT8_MAX + 1 && compileInputs(source, &formula->chunk, inputs, inputCount);
+    vm.registerMachine = registerMachine;
+    if (!compiled) {
+        if (inputCount > UINT8_MAX + 1) fprintf(vm.err, "Too many inputs in one formula.\n");
+        freeChunk(&formula->chunk);
+        return false;
+    }
+
+    formula->vectorized = planKernels(formula);
+    if (!formula->vectorized) {
+        FREE_ARRAY(Step, formula->steps, formula->chunk.count);
+        formula->steps = NULL;
+    }
+    freezeChunk(&formula->chunk);
+    return true;
+}
+
+void freeFormula(Formula* formula) {
+    if (formula->steps != NULL) FREE_ARRAY(Step, formula->steps, formula->chunk.count);
+    freeChunk(&formula->chunk);
+}
+
+#define BINARY_KERNEL(name, expression) \
+    static void name(double* restrict a, const double* restrict b) { \
+        for (int i = 0; i < BATCH_LANES; i++) a[i] = (expression); \
+    }
+
+BINARY_KERNEL(addLanes, a[i] + b[i])
+BINARY_KERNEL(subtractLanes, a[i] - b[i])
+BINARY_KERNEL(multiplyLanes, a[i] * b[i])
+BINARY_KERNEL(divideLanes, a[i] / b[i])
+BINARY_KERNEL(lessLanes, (double)(a[i] < b[i]))
+BINARY_KERNEL(greaterLanes, (double)(a[i] > b[i]))
+BINARY_KERNEL(equalLanes, (double)(a[i] == b[i]))
+
+#undef BINARY_KERNEL
+
+static void fillLanes(double* restrict a, double constant) {
+    for (int i = 0; i < BATCH_LANES; i++) a[i] = constant;
+}
+
+static void notLanes(double* restrict a) {
+    for (int i = 0; i < BATCH_LANES; i++) a[i] = 1.0 - a[i];
+}
+
+static void negateLanes(double* restrict a) {
+    for (int i = 0; i < BATCH_LANES; i++) a[i] = -a[i];
+}
+
+// Runs the steps over rows [row, row + count), count being at most BATCH_LANES. stack has maxDepth slots of BATCH_LANES.
+static void runKernels(Formula* formula, const double* columns[], long row, int count, double* stack, Value* results) {
+    double* top = stack; // The slot on top of the stack. Every formula starts with a push, which fills this one.
+    int depth = 0;
+
+#define PUSH_SLOT() (top = stack + BATCH_LANES * depth++)
+#define POP_SLOT() (top = stack + BATCH_LANES * (--depth - 1))
+    for (int i = 0; i < formula->stepCount; i++) {
+        Step* step = &formula->steps[i];
+        switch (step->kernel) {
+            case KERNEL_PUSH:
+                PUSH_SLOT();
+                fillLanes(top, step->constant);
+                break;
+            case KERNEL_INPUT:
+                PUSH_SLOT();
+                memcpy(top, columns[step->index] + row, sizeof(double) * count);
+                if (count < BATCH_LANES) memset(top + count, 0, sizeof(double) * (BATCH_LANES - count)); // Keep the unused lanes tame
+                break;
+            case KERNEL_ADD:      POP_SLOT(); addLanes(top, top + BATCH_LANES); break;
+            case KERNEL_SUBTRACT: POP_SLOT(); subtractLanes(top, top + BATCH_LANES); break;
+            case KERNEL_MULTIPLY: POP_SLOT(); multiplyLanes(top, top + BATCH_LANES); break;
+            case KERNEL_DIVIDE:   POP_SLOT(); divideLanes(top, top + BATCH_LANES); break;
+            case KERNEL_LESS:     POP_SLOT(); lessLanes(top, top + BATCH_LANES); break;
+            case KERNEL_GREATER:  POP_SLOT(); greaterLanes(top, top + BATCH_LANES); break;
+            case KERNEL_EQUAL:    POP_SLOT(); equalLanes(top, top + BATCH_LANES); break;
+            case KERNEL_NOT:      notLanes(top); break;
+            case KERNEL_NEGATE:   negateLanes(top); break;
+            case KERNEL_REPLACE:
+                if (step->index == 2) POP_SLOT();
+                fillLanes(top, step->constant);
+                break;
+            case KERNEL_RETURN:
+                switch (formula->resultType) {
+                    case LANE_NUMBER: for (int lane = 0; lane < count; lane++) results[row + lane] = NUMBER_VAL(top[lane]); break;
+                    case LANE_BOOL:   for (int lane = 0; lane < count; lane++) results[row + lane] = BOOL_VAL(top[lane] != 0); break;
+                    default:          for (int lane = 0; lane < count; lane++) results[row + lane] = NIL_VAL; break;
+                }
+                return;
+        }
+    }
+#undef PUSH_SLOT
+#undef POP_SLOT
+}
+
+typedef struct {
+    Formula* formula;
+    const double** columns;
+    long start;
+    long end;
+    double* stack;
+    Value* results;
+} Slice; // One thread's share of the rows
+
+static void* runSlice(void* argument) {
+    Slice* slice = (Slice*)argument;
+    for (long row = slice->start; row < slice->end; row += BATCH_LANES) {
+        long left = slice->end - row;
+        runKernels(slice->formula, slice->columns, row, left < BATCH_LANES ? (int)left : BATCH_LANES, slice->stack, slice->results);
+    }
+    return NULL;
+}
+
+// The row by row path. Everything here goes through the one VM, so it stays on the calling thread.
+static long runRows(Formula* formula, const double* columns[], long rows, Value* results) {
+    Value* inputs = ALLOCATE(Value, formula->inputCount > 0 ? formula->inputCount : 1);
+    long failed = 0;
+    for (long row = 0; row < rows; row++) {
+        for (int i = 0; i < formula->inputCount; i++) inputs[i] = NUMBER_VAL(columns[i][row]);
+        if (runRow(&formula->chunk, inputs, &results[row]) != INTERPRET_OK) {
+            // Every row sees the same types, so the rest would fail the same way. One copy of the error is plenty.
+            for (long rest = row; rest < rows; rest++) results[rest] = NIL_VAL;
+            failed = rows - row;
+            break;
+        }
+    }
+    FREE_ARRAY(Value, inputs, formula->inputCount > 0 ? formula->inputCount : 1);
+    return failed;
+}
+
+/*
+  Evaluates the formula for every row, columns[i][row] being input i, and stores each row's value in results[row].
+  Vectorized formulas split the rows over up to threads threads. Strings a formula makes stay allocated until freeObjects().
+  Returns how many rows hit a runtime error. Those get nil, and the error is reported once.
+*/
+long evaluateFormula(Formula* formula, const double* columns[], long rows, Value* results, int threads) {
+    if (!formula->vectorized) return runRows(formula, columns, rows, results);
+
+#ifdef _WIN32
+    threads = 1;
+#endif
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    long blocks = (rows + BATCH_LANES - 1) / BATCH_LANES;
+    if (threads > blocks) threads = (int)blocks;
+    if (threads < 1) threads = 1;
+
+    // Kernel stacks use plain malloc, since the threads can't share the VM's allocation counter
+    Slice slices[MAX_THREADS];
+    size_t stackSize = sizeof(double) * BATCH_LANES * (formula->maxDepth > 0 ? formula->maxDepth : 1);
+    long blocksEach = (blocks + threads - 1) / threads;
+    for (int i = 0; i < threads; i++) {
+        long start = i * blocksEach * BATCH_LANES;
+        long end = start + blocksEach * BATCH_LANES;
+        slices[i] = (Slice){formula, columns, start < rows ? start : rows, end < rows ? end : rows, malloc(stackSize), results};
+        if (slices[i].stack == NULL) {
+            fprintf(stderr, "Not enough memory to evaluate a formula.\n");
+            exit(1);
+        }
+    }
+
+#ifndef _WIN32
+    pthread_t workers[MAX_THREADS];
+    int started = 1; // The calling thread takes the first slice itself
+    for (; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, runSlice, &slices[started]) != 0) break;
+    }
+    runSlice(&slices[0]);
+    for (int i = 1; i < started; i++) pthread_join(workers[i], NULL);
+    for (int i = started; i < threads; i++) runSlice(&slices[i]); // Couldn't get a thread, so do it here
+#else
+    runSlice(&slices[0]);
+#endif
+
+    for (int i = 0; i < threads; i++) free(slices[i].stack);
+    return 0;
+}
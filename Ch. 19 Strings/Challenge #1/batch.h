@@ -0,0 +1,52 @@
+#ifndef clox_batch_h
+#define clox_batch_h
+
+#include "chunk.h"
+#include "value.h"
+
+#define BATCH_LANES 256 // Rows the kernels work through per instruction. A multiple of any vector width we'll meet.
+
+typedef enum {
+    LANE_NUMBER,
+    LANE_BOOL,   // Stored as 0 or 1
+    LANE_NIL,
+    LANE_OTHER   // Strings, or operands that would be a runtime error. No kernel for these, rows go through run() instead.
+} LaneType;
+
+typedef enum {
+    KERNEL_PUSH,    // Pushes constant in every lane
+    KERNEL_INPUT,   // Pushes a slice of column index
+    KERNEL_ADD,
+    KERNEL_SUBTRACT,
+    KERNEL_MULTIPLY,
+    KERNEL_DIVIDE,
+    KERNEL_LESS,
+    KERNEL_GREATER,
+    KERNEL_EQUAL,
+    KERNEL_NOT,     // Of a bool. ! of anything else is known without looking at the lanes, so it's a KERNEL_REPLACE.
+    KERNEL_NEGATE,
+    KERNEL_REPLACE, // Replaces the top index (1 or 2) values with constant, for results the types alone decide
+    KERNEL_RETURN
+} Kernel;
+
+typedef struct {
+    Kernel kernel;
+    int index;
+    double constant;
+} Step;
+
+typedef struct {
+    Chunk chunk;
+    int inputCount;
+    bool vectorized;     // Every instruction has a kernel for the types it sees, so no row needs run()
+    Step* steps;         // The chunk translated to kernels, when vectorized
+    int stepCount;
+    int maxDepth;        // Stack slots the kernels need
+    LaneType resultType;
+} Formula; // An expression compiled once, then evaluated over whole columns of numbers
+
+bool compileFormula(Formula* formula, const char* source, const char* inputs[], int inputCount);
+long evaluateFormula(Formula* formula, const double* columns[], long rows, Value* results, int threads);
+void freeFormula(Formula* formula);
+
+#endif
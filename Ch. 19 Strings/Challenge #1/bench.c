@@ -0,0 +1,519 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "batch.h"
+#include "compiler.h"
+#include "incremental.h"
+#include "intern.h"
+#include "memo.h"
+#include "memory.h"
+#include "object.h"
+#include "scanner.h"
+#include "vm.h"
+
+/*
+  Benchmark harness, built by "make bench". Links against everything but main.c.
+  Each workload is generated at a few sizes, and each size is timed in four parts on its own:
+    scan     initScanner() and scanToken() until EOF
+    compile  compile() into a fresh chunk, then freeChunk()
+    run      runChunk() on one compiled (and frozen) chunk, output going nowhere
+    alloc    copyString() on every 16 byte slice of the source, then freeObjects(). Slices get shared (see intern.h), so
+             after the first batch this is mostly lookups, like a compiler seeing the same literals again.
+  The formula benchmarks time evaluateFormula() over FORMULA_ROWS rows: row by row through run(), then with the kernels on 1 and
+  FORMULA_THREADS threads. Divide by FORMULA_ROWS for the time per row.
+  The intern benchmarks have 1 and INTERN_THREADS threads each copyString() all INTERN_KEYS identifier-like keys, which are
+  already shared, so every call is a hit and the threads contend for the same shards. Divide by INTERN_KEYS for the time per lookup.
+  The edit benchmarks keep a source compiled with incremental.h. reload is setSource() on all of it, number flips one digit
+  near the middle (the constant gets patched) and operator swaps an operator near the middle (the tokens get parsed again).
+  The memo benchmarks time interpret() on the same source over and over, without and then with memo.h remembering it.
+  Every timing is the best of several batches, and each batch repeats until it takes long enough for the clock to be trusted.
+
+  Usage: clox-bench [--json=path] [--compare=baseline.json] [--threshold=percent] [--filter=text] [--registers] [--jit]
+  --compare exits with 1 if anything got slower than the threshold (default 10%).
+*/
+
+#define BATCHES 5
+#define MIN_BATCH_SECONDS 0.02
+#define MAX_RESULTS 128
+#define MAX_CONSTANTS 250 // A chunk holds 256 constants, and every number or string literal takes one
+#define FORMULA_ROWS 65536
+#define FORMULA_THREADS 4
+#define INTERN_KEYS 4096
+#define INTERN_THREADS 4
+
+typedef struct {
+    char name[64];
+    double ns;      // Per iteration
+    double bytes;   // Source bytes per iteration, for throughput. 0 when it doesn't apply.
+} Result;
+
+typedef struct {
+    const char* name;
+    char* source;
+} Workload;
+
+static Result results[MAX_RESULTS];
+static int resultCount = 0;
+static const char* filter = NULL;
+
+static double now() {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// A string that grows as workloads get generated into it
+typedef struct {
+    char* chars;
+    size_t length;
+    size_t capacity;
+} Builder;
+
+static void append(Builder* builder, const char* text) {
+    size_t length = strlen(text);
+    if (builder->length + length + 1 > builder->capacity) {
+        while (builder->length + length + 1 > builder->capacity) builder->capacity = builder->capacity < 64 ? 64 : builder->capacity * 2;
+        builder->chars = (char*)realloc(builder->chars, builder->capacity);
+        if (builder->chars == NULL) exit(1);
+    }
+    memcpy(builder->chars + builder->length, text, length + 1);
+    builder->length += length;
+}
+
+// 1 + 2 * 3 - 4 / 5 ... with count numbers (at most MAX_CONSTANTS)
+static char* arithmeticChain(int count) {
+    static const char* operators[] = {" + ", " * ", " - ", " / "};
+    Builder builder = {NULL, 0, 0};
+    char number[32];
+    for (int i = 0; i < count; i++) {
+        if (i > 0) append(&builder, operators[i % 4]);
+        snprintf(number, sizeof(number), "%d", i + 1);
+        append(&builder, number);
+    }
+    append(&builder, "\n");
+    return builder.chars;
+}
+
+// -(-(-(...1...))) nested depth times. Exercises the compiler's recursion more than anything.
+static char* deepNesting(int depth) {
+    Builder builder = {NULL, 0, 0};
+    for (int i = 0; i < depth; i++) append(&builder, "-(");
+    append(&builder, "1");
+    for (int i = 0; i < depth; i++) append(&builder, ")");
+    append(&builder, "\n");
+    return builder.chars;
+}
+
+// !true == false == !nil ... Literals that don't need constants, so this one can get as long as we like
+static char* manyLiterals(int count) {
+    static const char* literals[] = {"!true", "false", "!nil", "true", "!false", "nil"};
+    Builder builder = {NULL, 0, 0};
+    for (int i = 0; i < count; i++) {
+        if (i > 0) append(&builder, " == ");
+        append(&builder, literals[i % 6]);
+    }
+    append(&builder, "\n");
+    return builder.chars;
+}
+
+// "abcdefghijklmnop" + "abcdefghijklmnop" + ... count strings, each concatenation copying everything so far
+static char* concatenation(int count) {
+    Builder builder = {NULL, 0, 0};
+    for (int i = 0; i < count; i++) {
+        if (i > 0) append(&builder, " + ");
+        append(&builder, "\"abcdefghijklmnop\"");
+    }
+    append(&builder, "\n");
+    return builder.chars;
+}
+
+static bool wanted(const char* name) {
+    return filter == NULL || strstr(name, filter) != NULL;
+}
+
+static void addResult(const char* workload, const char* part, double ns, double bytes) {
+    if (resultCount == MAX_RESULTS) return;
+    Result* result = &results[resultCount++];
+    snprintf(result->name, sizeof(result->name), "%s/%s", workload, part);
+    result->ns = ns;
+    result->bytes = bytes;
+    if (bytes > 0) {
+        printf("%-28s %12.1f ns %10.1f MB/s\n", result->name, ns, bytes / ns * 1e3);
+    } else {
+        printf("%-28s %12.1f ns\n", result->name, ns);
+    }
+}
+
+// Calls body(context) until a batch takes long enough, BATCHES times, and returns the best nanoseconds per call
+static double timeIt(void (*body)(void*), void* context) {
+    long iterations = 1;
+    for (;;) { // Find how many iterations make a batch long enough
+        double start = now();
+        for (long i = 0; i < iterations; i++) body(context);
+        if (now() - start >= MIN_BATCH_SECONDS) break;
+        iterations *= 2;
+    }
+
+    double best = 0;
+    for (int batch = 0; batch < BATCHES; batch++) {
+        double start = now();
+        for (long i = 0; i < iterations; i++) body(context);
+        double ns = (now() - start) / iterations * 1e9;
+        if (batch == 0 || ns < best) best = ns;
+    }
+    return best;
+}
+
+static void scanBody(void* context) {
+    initScanner((const char*)context);
+    while (scanToken().type != TOKEN_EOF);
+}
+
+static void compileBody(void* context) {
+    Chunk chunk;
+    initChunk(&chunk);
+    compile((const char*)context, &chunk);
+    freeChunk(&chunk);
+    freeObjects(); // The string constants
+}
+
+static void runBody(void* context) {
+    int before = vm.objects.count;
+    runChunk((Chunk*)context);
+    vm.out.count = 0; // Nobody reads it, and flushing would time stdio instead of the VM
+
+    while (vm.objects.count > before) { // Strings the run made, so the heap doesn't grow with the iteration count
+        freeObject(OBJECT_AT(&vm.objects, vm.objects.count - 1));
+        removeObject(&vm.objects, vm.objects.count - 1);
+    }
+}
+
+static void allocateBody(void* context) {
+    Workload* workload = (Workload*)context;
+    // One string per 16 source bytes, as long as the ones the concatenation workload makes on average
+    size_t length = strlen(workload->source);
+    for (size_t offset = 0; offset + 16 <= length; offset += 16) copyString(workload->source + offset, 16);
+    freeObjects();
+}
+
+static void benchmark(const char* name, char* source) {
+    if (!wanted(name)) {
+        free(source);
+        return;
+    }
+    double bytes = (double)strlen(source);
+    Workload workload = {name, source};
+
+    addResult(name, "scan", timeIt(scanBody, source), bytes);
+    addResult(name, "compile", timeIt(compileBody, source), bytes);
+
+    Chunk chunk;
+    initChunk(&chunk);
+    if (compile(source, &chunk)) {
+        freezeChunk(&chunk);
+        addResult(name, "run", timeIt(runBody, &chunk), 0);
+    } else {
+        fprintf(stderr, "%s didn't compile, skipping run.\n", name);
+    }
+    freeChunk(&chunk);
+
+    addResult(name, "alloc", timeIt(allocateBody, &workload), bytes);
+    freeObjects();
+    free(source);
+}
+
+typedef struct {
+    Formula formula;
+    const double* columns[3];
+    Value* results;
+    int threads;
+} FormulaRun;
+
+static void formulaBody(void* context) {
+    FormulaRun* run = (FormulaRun*)context;
+    evaluateFormula(&run->formula, run->columns, FORMULA_ROWS, run->results, run->threads);
+}
+
+static void benchmarkFormula(const char* name, const char* source) {
+    if (!wanted(name)) return;
+    static const char* inputs[] = {"price", "quantity", "discount"};
+    FormulaRun run;
+    if (!compileFormula(&run.formula, source, inputs, 3)) {
+        fprintf(stderr, "%s didn't compile, skipping it.\n", name);
+        return;
+    }
+
+    double* columns[3];
+    for (int i = 0; i < 3; i++) {
+        columns[i] = (double*)malloc(sizeof(double) * FORMULA_ROWS);
+        if (columns[i] == NULL) exit(1);
+        for (long row = 0; row < FORMULA_ROWS; row++) columns[i][row] = (double)((row * (i * 2 + 7)) % 101) + 0.25 * i;
+        run.columns[i] = columns[i];
+    }
+    run.results = (Value*)malloc(sizeof(Value) * FORMULA_ROWS);
+    if (run.results == NULL) exit(1);
+    double bytes = (double)sizeof(double) * 3 * FORMULA_ROWS;
+
+    bool vectorized = run.formula.vectorized;
+    run.formula.vectorized = false;
+    run.threads = 1;
+    addResult(name, "scalar", timeIt(formulaBody, &run), bytes);
+    run.formula.vectorized = vectorized;
+    if (vectorized) {
+        addResult(name, "vector", timeIt(formulaBody, &run), bytes);
+        run.threads = FORMULA_THREADS;
+        addResult(name, "vector-threads", timeIt(formulaBody, &run), bytes);
+    }
+
+    freeFormula(&run.formula);
+    for (int i = 0; i < 3; i++) free(columns[i]);
+    free(run.results);
+}
+
+static void interpretBody(void* context) {
+    int before = vm.objects.count;
+    interpret((const char*)context);
+    vm.out.count = 0;
+
+    while (vm.objects.count > before) {
+        freeObject(OBJECT_AT(&vm.objects, vm.objects.count - 1));
+        removeObject(&vm.objects, vm.objects.count - 1);
+    }
+}
+
+static void benchmarkMemo(const char* name, char* source) {
+    if (!wanted(name)) {
+        free(source);
+        return;
+    }
+    double bytes = (double)strlen(source);
+    addResult(name, "interpret", timeIt(interpretBody, source), bytes);
+    startMemo(MEMO_ENTRIES);
+    addResult(name, "memo", timeIt(interpretBody, source), bytes);
+    stopMemo();
+    free(source);
+}
+
+typedef struct {
+    Incremental incremental;
+    char* source;
+    int length;
+    int at;     // Where the edit goes
+    char swap;  // What goes there on every other edit
+    char original;
+    bool flipped;
+} EditRun;
+
+static void reloadBody(void* context) {
+    EditRun* run = (EditRun*)context;
+    setSource(&run->incremental, run->source, run->length);
+}
+
+static void editBody(void* context) {
+    EditRun* run = (EditRun*)context;
+    run->flipped = !run->flipped;
+    editSource(&run->incremental, run->at, 1, run->flipped ? &run->swap : &run->original, 1);
+}
+
+// The char nearest the middle of source that's one of chars, or -1
+static int nearMiddle(const char* source, int length, const char* chars) {
+    for (int distance = 0; distance <= length / 2; distance++) {
+        int before = length / 2 - distance;
+        int after = length / 2 + distance;
+        if (before >= 0 && strchr(chars, source[before]) != NULL) return before;
+        if (after < length && strchr(chars, source[after]) != NULL) return after;
+    }
+    return -1;
+}
+
+static void benchmarkEdit(const char* name, char* source, const char* digits, const char* operators, char swap) {
+    if (!wanted(name)) {
+        free(source);
+        return;
+    }
+    EditRun run;
+    initIncremental(&run.incremental);
+    run.source = source;
+    run.length = (int)strlen(source);
+    if (!setSource(&run.incremental, source, run.length)) {
+        fprintf(stderr, "%s didn't compile, skipping it.\n", name);
+        freeIncremental(&run.incremental);
+        free(source);
+        return;
+    }
+    addResult(name, "reload", timeIt(reloadBody, &run), run.length);
+
+    run.at = nearMiddle(source, run.length, digits);
+    if (run.at >= 0) {
+        run.original = source[run.at];
+        run.swap = run.original == '9' ? '8' : run.original + 1;
+        run.flipped = false;
+        addResult(name, "number", timeIt(editBody, &run), 0);
+        setSource(&run.incremental, source, run.length);
+    }
+
+    run.at = nearMiddle(source, run.length, operators);
+    run.original = source[run.at];
+    run.swap = swap;
+    run.flipped = false;
+    addResult(name, "operator", timeIt(editBody, &run), 0);
+
+    freeIncremental(&run.incremental);
+    freeObjects();
+    free(source);
+}
+
+typedef struct {
+    char keys[INTERN_KEYS][16];
+    int lengths[INTERN_KEYS];
+    int threads;
+} InternRun;
+
+static void* lookupKeys(void* context) {
+    InternRun* run = (InternRun*)context;
+    for (int i = 0; i < INTERN_KEYS; i++) copyString(run->keys[i], run->lengths[i]);
+    return NULL;
+}
+
+// Every thread looks up every key once, all at the same time
+static void internBody(void* context) {
+    InternRun* run = (InternRun*)context;
+#ifndef _WIN32
+    pthread_t workers[INTERN_THREADS];
+    int started = 0;
+    while (started < run->threads - 1 && pthread_create(&workers[started], NULL, lookupKeys, run) == 0) started++;
+    lookupKeys(run);
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+#else
+    for (int i = 0; i < run->threads; i++) lookupKeys(run);
+#endif
+}
+
+static void benchmarkIntern(const char* name) {
+    if (!wanted(name)) return;
+    static InternRun run; // Too big for the stack on some platforms
+    double bytes = 0;
+    for (int i = 0; i < INTERN_KEYS; i++) {
+        run.lengths[i] = snprintf(run.keys[i], sizeof(run.keys[i]), "name%d", i * 7919); // Spread out, so neighbours don't share a prefix
+        bytes += run.lengths[i];
+    }
+    run.threads = 1;
+    lookupKeys(&run); // Shares them all
+
+    addResult(name, "lookup", timeIt(internBody, &run), bytes);
+    run.threads = INTERN_THREADS;
+    addResult(name, "lookup-threads", timeIt(internBody, &run), bytes * INTERN_THREADS);
+}
+
+static bool writeJson(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+    // One result per line, which is also what --compare reads back
+    fprintf(file, "{\"unit\": \"ns\", \"results\": [\n");
+    for (int i = 0; i < resultCount; i++) {
+        fprintf(file, "  {\"name\": \"%s\", \"ns\": %.1f, \"bytes\": %.0f}%s\n",
+                results[i].name, results[i].ns, results[i].bytes, i < resultCount - 1 ? "," : "");
+    }
+    fprintf(file, "]}\n");
+    fclose(file);
+    return true;
+}
+
+// Compares against a file writeJson() made. Returns how many results got slower by more than threshold percent.
+static int compare(const char* path, double threshold) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open baseline \"%s\".\n", path);
+        return -1;
+    }
+
+    int regressions = 0;
+    char line[256];
+    printf("\n%-28s %12s %12s %8s\n", "benchmark", "baseline", "now", "change");
+    while (fgets(line, sizeof(line), file)) {
+        char name[64];
+        double ns;
+        if (sscanf(line, " {\"name\": \"%63[^\"]\", \"ns\": %lf", name, &ns) != 2) continue;
+
+        for (int i = 0; i < resultCount; i++) {
+            if (strcmp(results[i].name, name) != 0) continue;
+            double change = (results[i].ns - ns) / ns * 100;
+            bool regressed = change > threshold;
+            if (regressed) regressions++;
+            printf("%-28s %12.1f %12.1f %+7.1f%%%s\n", name, ns, results[i].ns, change, regressed ? "  REGRESSION" : "");
+        }
+    }
+    fclose(file);
+    return regressions;
+}
+
+int main(int argc, const char* argv[]) {
+    const char* jsonPath = NULL;
+    const char* baselinePath = NULL;
+    double threshold = 10;
+
+    initVM();
+    FILE* nowhere = fopen("/dev/null", "w");
+    if (nowhere != NULL) initOutput(&vm.out, nowhere); // Whatever the workloads print
+
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--json=", 7) == 0) {
+            jsonPath = argv[i] + 7;
+        } else if (strncmp(argv[i], "--compare=", 10) == 0) {
+            baselinePath = argv[i] + 10;
+        } else if (strncmp(argv[i], "--threshold=", 12) == 0) {
+            threshold = atof(argv[i] + 12);
+        } else if (strncmp(argv[i], "--filter=", 9) == 0) {
+            filter = argv[i] + 9;
+        } else if (strcmp(argv[i], "--registers") == 0) {
+            vm.registerMachine = true;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            vm.jitEnabled = true;
+        } else {
+            fprintf(stderr, "Usage: clox-bench [--json=path] [--compare=baseline.json] [--threshold=percent] [--filter=text] [--registers] [--jit]\n");
+            return 64;
+        }
+    }
+
+    benchmark("arith-16", arithmeticChain(16));
+    benchmark("arith-64", arithmeticChain(64));
+    benchmark("arith-250", arithmeticChain(MAX_CONSTANTS));
+    benchmark("nesting-10", deepNesting(10));
+    benchmark("nesting-100", deepNesting(100));
+    benchmark("nesting-1000", deepNesting(1000));
+    benchmark("literals-100", manyLiterals(100));
+    benchmark("literals-1000", manyLiterals(1000));
+    benchmark("literals-10000", manyLiterals(10000));
+    benchmark("concat-16", concatenation(16));
+    benchmark("concat-64", concatenation(64));
+    benchmark("concat-250", concatenation(MAX_CONSTANTS));
+    benchmarkFormula("formula-arith", "price * quantity - discount / 2");
+    benchmarkFormula("formula-logic", "price * quantity - discount / 2 > 100 == !(quantity < 3)");
+    benchmarkIntern("intern");
+    benchmarkMemo("memo-arith-64", arithmeticChain(64));
+    benchmarkMemo("memo-concat-64", concatenation(64));
+    benchmarkEdit("edit-arith-64", arithmeticChain(64), "0123456789", "+", '*');
+    benchmarkEdit("edit-arith-250", arithmeticChain(MAX_CONSTANTS), "0123456789", "+", '*');
+    benchmarkEdit("edit-nesting-1000", deepNesting(1000), "0123456789", "-", '!');
+    benchmarkEdit("edit-literals-10000", manyLiterals(10000), "", "!", '-');
+
+    int status = 0;
+    if (jsonPath != NULL && !writeJson(jsonPath)) status = 74;
+    if (baselinePath != NULL) {
+        int regressions = compare(baselinePath, threshold);
+        if (regressions != 0) status = 1;
+    }
+
+    freeVM();
+    if (nowhere != NULL) fclose(nowhere);
+    return status;
+}
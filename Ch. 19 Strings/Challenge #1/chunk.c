@@ -1,7 +1,17 @@
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
 
 #include "chunk.h"
 #include "memory.h"
+#include "vm.h"
+
+#define CACHE_LINE 64
 
 void initChunk(Chunk* chunk) {
     chunk->count = 0;
@@ -9,12 +19,52 @@ void initChunk(Chunk* chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->source = NULL;
+    chunk->registerCount = 0;
+    chunk->frozen = NULL;
+    chunk->frozenSize = 0;
+}
+
+// Pages for frozen chunks. Page aligned, so also cache line aligned.
+#ifdef _WIN32
+static void* allocateImage(size_t size) {
+    return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+}
+
+static bool protectImage(void* image, size_t size) {
+    DWORD old;
+    return VirtualProtect(image, size, PAGE_READONLY, &old) != 0;
 }
 
+static void freeImage(void* image, size_t size) {
+    VirtualFree(image, 0, MEM_RELEASE);
+}
+#else
+static void* allocateImage(size_t size) {
+    void* image = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return image == MAP_FAILED ? NULL : image;
+}
+
+static bool protectImage(void* image, size_t size) {
+    return mprotect(image, size, PROT_READ) == 0;
+}
+
+static void freeImage(void* image, size_t size) {
+    munmap(image, size);
+}
+#endif
+
 void freeChunk(Chunk* chunk) {
+    if (chunk->frozen != NULL) { // Everything lives in the one block, and the strings in it aren't on vm.objects
+        freeImage(chunk->frozen, chunk->frozenSize);
+        initChunk(chunk);
+        return;
+    }
+
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     FREE_ARRAY(int, chunk->lines, chunk->capacity);
     freeValueArray(&chunk->constants);
+    if (chunk->source != NULL) releaseSource(chunk->source); // The source might get unmapped here
     initChunk(chunk);
 }
 
@@ -34,4 +84,129 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
 int addConstant(Chunk* chunk, Value value) {
     writeValueArray(&chunk->constants, value);
     return chunk->constants.count - 1; // Returns -1 because writeValueArray increments count
-}
\ No newline at end of file
+}
+
+static size_t alignUp(size_t size, size_t alignment) {
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+// Whether freezing moved a string constant somewhere else, leaving the original heap string unused
+static bool replacedString(Value before, Value after) {
+    return IS_STRING(before) && AS_OBJ(before) != AS_OBJ(after);
+}
+
+// Frees the heap strings freezing replaced. They were the last objects made when the chunk was compiled, so they're at the end of vm.objects.
+static void freeReplacedStrings(ValueArray* constants, Value* frozen) {
+    int remaining = 0;
+    for (int i = 0; i < constants->count; i++) {
+        if (replacedString(constants->values[i], frozen[i])) remaining++;
+    }
+
+    for (int index = vm.objects.count - 1; index >= 0 && remaining > 0; index--) {
+        Obj* object = OBJECT_AT(&vm.objects, index);
+        bool isReplaced = false;
+        for (int i = 0; i < constants->count; i++) {
+            if (replacedString(constants->values[i], frozen[i]) && AS_OBJ(constants->values[i]) == object) {
+                isReplaced = true;
+                break;
+            }
+        }
+
+        if (isReplaced) {
+            removeObject(&vm.objects, index); // Fills the slot from the end, which has already been looked at
+            freeObject(object);
+            remaining--;
+        }
+    }
+}
+
+#ifdef OBJECT_COMPRESSION
+// Compressed references can only point into the object region, so string constants stay heap objects instead of moving
+// into the block. Borrowed ones still get copied, since the chunk is about to let go of its Source.
+#define FROZEN_STRING_SIZE(string) 0
+
+static Value freezeString(ObjString* original, uint8_t** strings) {
+    (void)strings;
+    if (!IS_BORROWED(original)) return OBJ_VAL(original);
+    return OBJ_VAL(copyString(original->chars, original->length));
+}
+#else
+#define FROZEN_STRING_SIZE(string) ((string)->obj.shared ? 0 : alignUp(sizeof(ObjString) + (string)->length + 1, sizeof(void*)))
+
+// Copies a string constant (header and bytes) to *strings and moves that past it. Shared strings outlive any chunk, so they stay put.
+static Value freezeString(ObjString* original, uint8_t** strings) {
+    if (original->obj.shared) return OBJ_VAL(original);
+    ObjString* string = (ObjString*)*strings;
+    string->obj.type = OBJ_STRING; // Not added to vm.objects, the block owns it
+    string->obj.shared = false;
+    string->length = original->length;
+    memcpy(string->inlineChars, original->chars, original->length);
+    string->inlineChars[original->length] = '\0';
+    string->chars = string->inlineChars;
+    *strings += FROZEN_STRING_SIZE(original);
+    return OBJ_VAL(string);
+}
+#endif
+
+/*
+  Packs a finished chunk into one read-only block: code, then lines, then the constant pool, then the string constants
+  (header and bytes together), each section starting on its own cache line. run() and friends read the chunk through the
+  same fields as before, they just point into the block now. There's no slack from GROW_CAPACITY, the constants sit next
+  to the code that uses them, and since nothing in the block is ever written, any number of threads can share it.
+  The strings are copied, so the chunk no longer needs its Source either. Frozen chunks can't be written to.
+  Only chunks that get run again and again, or shared with forked workers, make up for the mmap(), copy, mprotect() and
+  munmap() this costs, so only prefork.c and batch.c ask for it. A chunk that runs once is left as compile() made it.
+  Returns false (leaving the chunk as it was) if the block couldn't be made.
+*/
+bool freezeChunk(Chunk* chunk) {
+    if (chunk->frozen != NULL) return true;
+
+    size_t codeSize = alignUp((size_t)chunk->count, CACHE_LINE);
+    size_t linesSize = alignUp(sizeof(int) * chunk->count, CACHE_LINE);
+    size_t constantsSize = alignUp(sizeof(Value) * chunk->constants.count, CACHE_LINE);
+    size_t stringsSize = 0;
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        if (IS_STRING(value)) stringsSize += FROZEN_STRING_SIZE(AS_STRING(value));
+    }
+
+    size_t size = codeSize + linesSize + constantsSize + stringsSize;
+    if (size == 0) return true; // Nothing to pack
+    uint8_t* image = (uint8_t*)allocateImage(size);
+    if (image == NULL) return false;
+
+    uint8_t* code = image;
+    int* lines = (int*)(image + codeSize);
+    Value* constants = (Value*)(image + codeSize + linesSize);
+    uint8_t* strings = image + codeSize + linesSize + constantsSize;
+
+    memcpy(code, chunk->code, (size_t)chunk->count);
+    memcpy(lines, chunk->lines, sizeof(int) * chunk->count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        constants[i] = IS_STRING(value) ? freezeString(AS_STRING(value), &strings) : value;
+    }
+
+    if (!protectImage(image, size)) {
+        freeImage(image, size);
+        return false;
+    }
+
+    freeReplacedStrings(&chunk->constants, constants);
+    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    int constantCount = chunk->constants.count;
+    freeValueArray(&chunk->constants);
+    if (chunk->source != NULL) releaseSource(chunk->source);
+
+    chunk->code = code;
+    chunk->lines = lines;
+    chunk->capacity = chunk->count;
+    chunk->constants.values = constants;
+    chunk->constants.count = constantCount;
+    chunk->constants.capacity = constantCount;
+    chunk->source = NULL;
+    chunk->frozen = image;
+    chunk->frozenSize = size;
+    return true;
+}
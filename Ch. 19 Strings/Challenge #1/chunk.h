@@ -2,6 +2,7 @@
 #define clox_chunk_h
 
 #include "common.h"
+#include "source.h"
 #include "value.h"
 
 typedef enum {
@@ -19,19 +20,42 @@ typedef enum {
     OP_NOT,
     OP_NEGATE,
     OP_RETURN,
+    OP_INPUT, // index. Pushes that input of the row being evaluated. Only batch formulas have these (see batch.h).
+
+    // Register machine opcodes, used instead of the ones above when vm.registerMachine is on.
+    // The first operand byte is a destination register. Source operands are "RK" bytes: below RK_CONSTANT they're a register,
+    // from RK_CONSTANT up they're a constant index (plus RK_CONSTANT), so most constants never need loading at all.
+    OP_LOAD_R,     // dst, constant index (for constants too far into the pool to fit in an RK byte)
+    OP_EQUAL_R,    // dst, rk, rk
+    OP_GREATER_R,  // dst, rk, rk
+    OP_LESS_R,     // dst, rk, rk
+    OP_ADD_R,      // dst, rk, rk
+    OP_SUBTRACT_R, // dst, rk, rk
+    OP_MULTIPLY_R, // dst, rk, rk
+    OP_DIVIDE_R,   // dst, rk, rk
+    OP_NOT_R,      // dst, rk
+    OP_NEGATE_R,   // dst, rk
+    OP_RETURN_R,   // rk
 } OpCode; // Operation Code
 
+#define RK_CONSTANT 128 // RK operands at or above this are constants. Also caps the number of registers.
+
 typedef struct {
     int count;     // Number of bytes being currently used
     int capacity;  // Max array capacity
     uint8_t* code; // Byte array because it is BYTEcode. Took me too long to make that connection.
     int* lines;
     ValueArray constants; // Constant pool. The stack will store an index into this array for constants.
+    Source* source; // The source this was compiled from, if string constants are allowed to point into it. Holds a reference.
+    int registerCount; // Size of the register file register machine code needs. 0 for stack code.
+    void* frozen;       // The read-only block code, lines and constants live in after freezeChunk(), or NULL
+    size_t frozenSize;
 } Chunk; // Chunk of bytecode
 
 void initChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 void freeChunk(Chunk* chunk);
 int addConstant(Chunk* chunk, Value value);
+bool freezeChunk(Chunk* chunk);
 
 #endif
\ No newline at end of file
@@ -5,7 +5,6 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define DEBUG_PRINT_CODE
-#define DEBUG_TRACE_EXECUTION
+// #define OBJECT_COMPRESSION // 8 byte Values and 32-bit object references (see value.h). Can also be passed as -DOBJECT_COMPRESSION.
 
 #endif
\ No newline at end of file
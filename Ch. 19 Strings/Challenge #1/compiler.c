@@ -1,17 +1,23 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
 #include "compiler.h"
+#include "debug.h"
+#include "intern.h"
+#include "memory.h"
 #include "scanner.h"
 
-#ifdef DEBUG_PRINT_CODE
-#include "debug.h"
-#endif
+#define MAX_NESTING 4096 // parsePrecedence() calls deep. Far more than STACK_MAX allows anyway, and far less than the C stack does.
 
 typedef struct {
     Token current;
     Token previous;
+    int currentIndex; // Where current and previous are in scanned.tokens, when compiling from there
+    int previousIndex;
+    int stackDepth; // Values the stack code emitted so far leaves on the VM's stack
+    int nesting;    // How deep parsePrecedence() has recursed
     bool hadError;
     bool panicMode;
 } Parser;
@@ -40,8 +46,28 @@ typedef struct {
     Precedence precedence; // The precedence of the infix expression when using this token as an operator
 } ParseRule; // Represents a row in the parser table (see line 178)
 
+typedef struct {
+    uint8_t operands[RK_CONSTANT]; // Where each value on the would-be stack lives, as an RK operand
+    int count;
+    int nextRegister; // Registers are handed out and freed like a stack, so this is also how many are in use
+} RegisterAllocator; // Only used when compiling for the register machine
+
+typedef struct {
+    Token* tokens;
+    int count;
+    int capacity;
+    int next;    // Next token advance() hands out
+    bool ready;  // The next compile() reads these instead of scanning
+} ScannedTokens; // Filled by prescan()
+
 Parser parser;
 Chunk* compilingChunk;
+RegisterAllocator registers;
+ScannedTokens scanned;
+const char** inputNames; // What identifiers can name, when compiling a batch formula. Otherwise there are none, and identifiers are an error.
+int inputCount;
+TokenMap* tokenMap; // Filled in while compileScanned() runs
+FILE* compileErrors; // Set while compiling off the VM's thread. Errors go here instead of vm.err, and vm.out and vm.phase are left alone.
 
 // For user-defined function, the "current chunk" becomes a bit more nuanced. So, this will hold that logic.
 static Chunk* currentChunk() {
@@ -51,21 +77,23 @@ static Chunk* currentChunk() {
 static void errorAt(Token* token, const char* message) {
     if (parser.panicMode) return; // If in panic mode, ignore errors until recovery point (will be added later)
     parser.panicMode = true;
+    FILE* errors = compileErrors != NULL ? compileErrors : vm.err;
+    if (compileErrors == NULL) flushOutput(&vm.out); // Keep errors in order with whatever was printed before them
     // Print to error stream the line of the error 
-    fprintf(stderr, "[line %d] Error", token->line); // I lowkey love C syntax
+    fprintf(errors, "[line %d] Error", token->line); // I lowkey love C syntax
 
     if (token->type == TOKEN_EOF) {
         // If at EOF (end of file), signify that
-        fprintf(stderr, " at end");
+        fprintf(errors, " at end");
     } else if (token->type == TOKEN_ERROR) {
         // Do nothing (errors found during scanning)
     } else {
         // Print which token the error is at
-        fprintf(stderr, " at '%.*s'", token->length, token->start);
+        fprintf(errors, " at '%.*s'", token->length, token->start);
     }
 
     // Print error message
-    fprintf(stderr, ": %s\n", message);
+    fprintf(errors, ": %s\n", message);
     parser.hadError = true;
 }
 
@@ -79,13 +107,24 @@ static void errorAtCurrent(const char* message) {
     errorAt(&parser.current, message);
 }
 
+// The next prescanned token. EOF repeats forever, same as with the scanner.
+static Token nextScanned() {
+    Token token = scanned.tokens[scanned.next];
+    if (token.type != TOKEN_EOF) scanned.next++;
+    return token;
+}
+
 // "Advance" a token in parsing/compilation. Basically, move the current token back one, then move forward a token
 static void advance() {
     parser.previous = parser.current; // Store the current token
+    parser.previousIndex = parser.currentIndex;
 
     // Error check loop. Continues only if there is an error, so the parser only sees valid tokens
     for (;;) {
-        parser.current = scanToken();
+        if (compileErrors == NULL) vm.phase = PHASE_SCAN; // Lets the sampler tell scanning and compiling apart
+        parser.currentIndex = scanned.next;
+        parser.current = scanned.ready ? nextScanned() : scanToken();
+        if (compileErrors == NULL) vm.phase = PHASE_COMPILE;
         if (parser.current.type != TOKEN_ERROR) break; 
 
         errorAtCurrent(parser.current.start);
@@ -104,6 +143,15 @@ static void consume(TokenType type, const char* message) {
 
 // Add a byte (opcode or operand) to the chunk. The previous token's line info is sent so that runtime errors are associated with that line.
 static void emitByte(uint8_t byte) {
+    if (tokenMap != NULL) {
+        int offset = currentChunk()->count;
+        if (offset == tokenMap->codeCapacity) {
+            int oldCapacity = tokenMap->codeCapacity;
+            tokenMap->codeCapacity = GROW_CAPACITY(oldCapacity);
+            tokenMap->code = GROW_ARRAY(int, tokenMap->code, oldCapacity, tokenMap->codeCapacity);
+        }
+        tokenMap->code[offset] = parser.previousIndex;
+    }
     writeChunk(currentChunk(), byte, parser.previous.line);
 }
 
@@ -112,14 +160,87 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
     emitByte(byte2);
 }
 
+// Stack code only, after emitting an instruction that pushes. run() has STACK_MAX slots and never checks, so this does.
+static void pushSlot() {
+    if (++parser.stackDepth > STACK_MAX) error("Expression too deeply nested.");
+}
+
+static void pushOperand(uint8_t operand) {
+    if (registers.count == RK_CONSTANT) {
+        error("Expression too complex.");
+        return;
+    }
+    registers.operands[registers.count++] = operand;
+}
+
+// Pops an operand. If it was in a register, that register is free again. It's always the newest one, since operands pop in stack order.
+static uint8_t popOperand() {
+    if (registers.count == 0) return RK_CONSTANT; // Only happens after a syntax error, and that code never runs
+    uint8_t operand = registers.operands[--registers.count];
+    if (operand < RK_CONSTANT) registers.nextRegister--;
+    return operand;
+}
+
+static uint8_t allocateRegister() {
+    if (registers.nextRegister == RK_CONSTANT) {
+        error("Expression too complex.");
+        return 0;
+    }
+    uint8_t reg = (uint8_t)registers.nextRegister++;
+    if (registers.nextRegister > currentChunk()->registerCount) currentChunk()->registerCount = registers.nextRegister;
+    return reg;
+}
+
+// Emits an operator. On the stack machine that's just the opcode. On the register machine its operands are popped, and the result goes in a new register.
+static void emitOperator(OpCode op) {
+    if (!vm.registerMachine) {
+        emitByte(op);
+        if (op != OP_NOT && op != OP_NEGATE) parser.stackDepth--; // Two operands in, one result out
+        return;
+    }
+
+    OpCode registerOp;
+    bool unary = false;
+    switch (op) {
+        case OP_EQUAL:    registerOp = OP_EQUAL_R; break;
+        case OP_GREATER:  registerOp = OP_GREATER_R; break;
+        case OP_LESS:     registerOp = OP_LESS_R; break;
+        case OP_ADD:      registerOp = OP_ADD_R; break;
+        case OP_SUBTRACT: registerOp = OP_SUBTRACT_R; break;
+        case OP_MULTIPLY: registerOp = OP_MULTIPLY_R; break;
+        case OP_DIVIDE:   registerOp = OP_DIVIDE_R; break;
+        case OP_NOT:      registerOp = OP_NOT_R; unary = true; break;
+        case OP_NEGATE:   registerOp = OP_NEGATE_R; unary = true; break;
+        default: return; // Unreachable
+    }
+
+    // Popping first lets the destination reuse an operand's register
+    uint8_t b = popOperand();
+    uint8_t a = unary ? 0 : popOperand();
+    uint8_t dst = allocateRegister();
+
+    emitBytes(registerOp, dst);
+    if (unary) {
+        emitByte(b);
+    } else {
+        emitBytes(a, b);
+    }
+    pushOperand(dst);
+}
+
 // When clox is run, it parses, compiles, and executes an expression, then prints it result. So, we temporarily use return to do that.
 static void emitReturn() {
-    emitByte(OP_RETURN);
+    if (vm.registerMachine) {
+        emitBytes(OP_RETURN_R, popOperand());
+    } else {
+        emitByte(OP_RETURN);
+    }
 }
 
 // Adds a value to the end of current chunk's constant table/pool, and then returns its index
 static uint8_t makeConstant(Value value) {
     int constantIndex = addConstant(currentChunk(), value);
+    if (tokenMap != NULL) tokenMap->constants[parser.previousIndex] = constantIndex;
     if (constantIndex > UINT8_MAX) {
         error("Too many constants in one chunk."); // Chunk of BYTEcode
         return 0;
@@ -130,16 +251,25 @@ static uint8_t makeConstant(Value value) {
 
 // Adds a constant to the constant table, pushes its index in the constant table onto the stack, then pushes a constant opcode onto the stack
 static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    uint8_t constant = makeConstant(value);
+    if (!vm.registerMachine) {
+        emitBytes(OP_CONSTANT, constant);
+        pushSlot();
+    } else if (constant < RK_CONSTANT) {
+        pushOperand(RK_CONSTANT + constant); // Instructions can read it straight from the pool, no code needed
+    } else {
+        uint8_t reg = allocateRegister();
+        emitBytes(OP_LOAD_R, reg);
+        emitByte(constant);
+        pushOperand(reg);
+    }
 }
 
 static void endCompiler() {
     emitReturn();
-#ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {  // Only dump chunk if there was no errors
+    if (vm.printCode && !parser.hadError) {  // Only dump chunk if there was no errors
         disassembleChunk(currentChunk(), "code");
     }
-#endif
 }
 
 // Forward declarations for use in grammar production methods
@@ -155,20 +285,31 @@ static void binary() {
     parsePrecedence((Precedence)(rule->precedence + 1)); // +1 because binary operations associate left
 
     switch (operatorType) {
-        case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
-        case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
-        case TOKEN_GREATER:       emitByte(OP_GREATER); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-        case TOKEN_LESS:          emitByte(OP_LESS); break;
-        case TOKEN_LESS_EQUAL:    emitBytes(OP_GREATER, OP_NOT); break;
-        case TOKEN_PLUS:          emitByte(OP_ADD); break;
-        case TOKEN_MINUS:         emitByte(OP_SUBTRACT); break;
-        case TOKEN_STAR:          emitByte(OP_MULTIPLY); break;
-        case TOKEN_SLASH:         emitByte(OP_DIVIDE); break;
+        case TOKEN_BANG_EQUAL:    emitOperator(OP_EQUAL); emitOperator(OP_NOT); break;
+        case TOKEN_EQUAL_EQUAL:   emitOperator(OP_EQUAL); break;
+        case TOKEN_GREATER:       emitOperator(OP_GREATER); break;
+        case TOKEN_GREATER_EQUAL: emitOperator(OP_LESS); emitOperator(OP_NOT); break;
+        case TOKEN_LESS:          emitOperator(OP_LESS); break;
+        case TOKEN_LESS_EQUAL:    emitOperator(OP_GREATER); emitOperator(OP_NOT); break;
+        case TOKEN_PLUS:          emitOperator(OP_ADD); break;
+        case TOKEN_MINUS:         emitOperator(OP_SUBTRACT); break;
+        case TOKEN_STAR:          emitOperator(OP_MULTIPLY); break;
+        case TOKEN_SLASH:         emitOperator(OP_DIVIDE); break;
     }
 }
 
 static void literal() {
+    // The register machine has no literal opcodes, they're just constants it can read directly
+    if (vm.registerMachine) {
+        switch (parser.previous.type) {
+            case TOKEN_FALSE: emitConstant(BOOL_VAL(false)); break;
+            case TOKEN_NIL: emitConstant(NIL_VAL); break;
+            case TOKEN_TRUE: emitConstant(BOOL_VAL(true)); break;
+            default: return; // Unreachable
+        }
+        return;
+    }
+
     // Keyword token has already been consumed
     switch (parser.previous.type) {
         case TOKEN_FALSE: emitByte(OP_FALSE); break;
@@ -176,6 +317,7 @@ static void literal() {
         case TOKEN_TRUE: emitByte(OP_TRUE); break;
         default: return; // Unreachable
     }
+    pushSlot();
 }
 
 static void grouping() {
@@ -196,7 +338,30 @@ static void number() {
 // Creates a String Obj, then wraps it in a Value
 static void string() {
     // +1 and -2 trim quotation marks
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+    const char* chars = parser.previous.start + 1;
+    int length = parser.previous.length - 2;
+
+    // Shared if it can be (see intern.h). If not, and the chunk is keeping the source alive, the literal can just point into it.
+    ObjString* string = vm.internLiterals ? internString(chars, length) : NULL;
+    if (string == NULL) string = currentChunk()->source != NULL ? borrowString(chars, length) : copyString(chars, length);
+    emitConstant(OBJ_VAL(string));
+}
+
+// An identifier names one of the formula's inputs
+static void input() {
+    for (int i = 0; i < inputCount; i++) {
+        if ((int)strlen(inputNames[i]) == parser.previous.length &&
+            memcmp(inputNames[i], parser.previous.start, parser.previous.length) == 0) {
+            if (vm.registerMachine) {
+                error("Inputs need the stack machine.");
+                return;
+            }
+            emitBytes(OP_INPUT, (uint8_t)i);
+            pushSlot();
+            return;
+        }
+    }
+    error(inputCount == 0 ? "Expect expression." : "Unknown input.");
 }
 
 static void unary() {
@@ -208,8 +373,8 @@ static void unary() {
 
     // Emit the operator instruction. 
     switch (operatorType) {
-        case TOKEN_BANG: emitByte(OP_NOT); break;
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+        case TOKEN_BANG: emitOperator(OP_NOT); break;
+        case TOKEN_MINUS: emitOperator(OP_NEGATE); break;
         default: return; // Unreachable
     }
 }
@@ -237,7 +402,7 @@ ParseRule rules[] = {
     [TOKEN_GREATER_EQUAL] = {NULL,     binary, PREC_COMPARISON},
     [TOKEN_LESS]          = {NULL,     binary, PREC_COMPARISON},
     [TOKEN_LESS_EQUAL]    = {NULL,     binary, PREC_COMPARISON},
-    [TOKEN_IDENTIFIER]    = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_IDENTIFIER]    = {input,    NULL,   PREC_NONE},
     [TOKEN_STRING]        = {string,   NULL,   PREC_NONE},
     [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
     [TOKEN_AND]           = {NULL,     NULL,   PREC_NONE},
@@ -261,12 +426,18 @@ ParseRule rules[] = {
 };
 
 static void parsePrecedence(Precedence precedence) {
+    if (parser.nesting == MAX_NESTING) { // Keeps a hostile source from running the compiler out of C stack
+        errorAtCurrent("Expression too deeply nested.");
+        return;
+    }
+    parser.nesting++;
     advance();
 
     // Parse prefix expression (the current token is ALWAYS a prefix expression)
     ParseFn prefixRule = getRule(parser.previous.type)->prefix;
     if (prefixRule == NULL) {
         error("Expect expression.");
+        parser.nesting--;
         return;
     }
 
@@ -278,6 +449,7 @@ static void parsePrecedence(Precedence precedence) {
         ParseFn infixRule = getRule(parser.previous.type)->infix;
         infixRule();
     }
+    parser.nesting--;
 }
 
 // Look up a ParseRule using a TokenType. This is necessary because binary() recursively accesses the table (which stores binary in a rule)
@@ -289,18 +461,68 @@ static void expression() {
     parsePrecedence(PREC_ASSIGNMENT);
 }
 
+// Scans all of source up front, so the next compile() of it only has to parse. Lets --phases time the two apart.
+void prescan(const char* source) {
+    initScanner(source);
+    scanned.count = 0;
+    scanned.next = 0;
+    for (;;) {
+        if (scanned.count == scanned.capacity) { // Plain realloc, since this is instrumentation and not the program's memory
+            scanned.capacity = scanned.capacity < 256 ? 256 : scanned.capacity * 2;
+            scanned.tokens = (Token*)realloc(scanned.tokens, sizeof(Token) * scanned.capacity);
+            if (scanned.tokens == NULL) exit(1);
+        }
+        Token token = scanToken();
+        scanned.tokens[scanned.count++] = token;
+        if (token.type == TOKEN_EOF) break;
+    }
+    scanned.ready = true;
+}
+
 bool compile(const char* source, Chunk* chunk) {
+    return compileInputs(source, chunk, NULL, 0);
+}
+
+// Compiles tokens someone already scanned, and notes which token each constant and byte of code came from
+bool compileScanned(const char* source, Token* tokens, int count, Chunk* chunk, TokenMap* map) {
+    ScannedTokens saved = scanned; // prescan()'s buffer, which stays its own
+    scanned.tokens = tokens;
+    scanned.count = count;
+    scanned.capacity = count;
+    scanned.next = 0;
+    scanned.ready = true;
+    for (int i = 0; i < count; i++) map->constants[i] = -1;
+    tokenMap = map;
+
+    bool compiled = compile(source, chunk);
+    tokenMap = NULL;
+    scanned = saved;
+    return compiled;
+}
+
+void compileOffThread(FILE* errors) {
+    compileErrors = errors;
+}
+
+bool compileInputs(const char* source, Chunk* chunk, const char* inputs[], int count) {
     // Initilization
     initScanner(source);
     compilingChunk = chunk;
+    inputNames = inputs;
+    inputCount = count;
 
 
     parser.hadError = false;
     parser.panicMode = false;
+    parser.stackDepth = 0;
+    parser.nesting = 0;
+    registers.count = 0;
+    registers.nextRegister = 0;
 
     advance();
     expression(); 
     consume(TOKEN_EOF, "Expect end of expression"); // Expect end of file
     endCompiler(); // Adds OP_RETURN to the end of the chunk
+    scanned.ready = false; // Prescanned tokens are good for one compile
     return !parser.hadError; // Returns whether or not compilation suceeded (false if theres an error)
 }
\ No newline at end of file
@@ -2,8 +2,19 @@
 #define clox_compiler_h
 
 #include "object.h"
+#include "scanner.h"
 #include "vm.h"
 
+typedef struct {
+    int* constants;   // Per token, the constant it compiled to, or -1. Sized by the caller.
+    int* code;        // Per byte of code, the token it was emitted for. Grown by the compiler.
+    int codeCapacity;
+} TokenMap;
+
 bool compile(const char* source, Chunk* chunk); // Returns whether or not compilation suceeded
+void prescan(const char* source);
+bool compileScanned(const char* source, Token* tokens, int count, Chunk* chunk, TokenMap* map);
+void compileOffThread(FILE* errors); // Until called with NULL, compile() reports to errors and leaves the VM's state alone
+bool compileInputs(const char* source, Chunk* chunk, const char* inputs[], int count); // Same, but identifiers name inputs (at most 256)
 
 #endif
\ No newline at end of file
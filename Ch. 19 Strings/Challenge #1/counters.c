@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "counters.h"
+
+const char* counterNames[COUNTER_COUNT] = {"cycles", "instructions", "branch misses", "LLC misses"};
+
+static int descriptors[COUNTER_COUNT] = {-1, -1, -1, -1};
+
+#ifdef __linux__
+
+static const uint64_t events[COUNTER_COUNT] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES,
+};
+
+// Each counter gets its own descriptor, so a CPU (or VM) missing one of them still gives us the rest
+bool startCounters() {
+    bool any = false;
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        struct perf_event_attr attributes;
+        memset(&attributes, 0, sizeof(attributes));
+        attributes.size = sizeof(attributes);
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.config = events[i];
+        attributes.exclude_kernel = 1; // Also what lets this work without privileges at the default paranoia level
+        attributes.exclude_hv = 1;
+        descriptors[i] = (int)syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0); // This thread, any CPU
+        if (descriptors[i] >= 0) any = true;
+    }
+    return any;
+}
+
+void readCounters(uint64_t values[COUNTER_COUNT]) {
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        values[i] = 0;
+        if (descriptors[i] >= 0 && read(descriptors[i], &values[i], sizeof(uint64_t)) != sizeof(uint64_t)) values[i] = 0;
+    }
+}
+
+void stopCounters() {
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (descriptors[i] >= 0) close(descriptors[i]);
+        descriptors[i] = -1;
+    }
+}
+
+#else
+
+bool startCounters() {
+    return false;
+}
+
+void readCounters(uint64_t values[COUNTER_COUNT]) {
+    for (int i = 0; i < COUNTER_COUNT; i++) values[i] = 0;
+}
+
+void stopCounters() {}
+
+#endif
+
+bool hasCounter(Counter counter) {
+    return descriptors[counter] >= 0;
+}
@@ -0,0 +1,23 @@
+#ifndef clox_counters_h
+#define clox_counters_h
+
+#include <stdint.h>
+
+#include "common.h"
+
+typedef enum {
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_CACHE_MISSES, // Last level cache, on most CPUs
+    COUNTER_COUNT
+} Counter; // Hardware counters, read through perf_event_open() where the kernel lets us
+
+extern const char* counterNames[COUNTER_COUNT];
+
+bool startCounters(); // Returns whether any counter could be opened
+bool hasCounter(Counter counter);
+void readCounters(uint64_t values[COUNTER_COUNT]); // Counters that aren't open read as 0
+void stopCounters();
+
+#endif
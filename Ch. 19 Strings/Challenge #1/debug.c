@@ -2,9 +2,43 @@
 
 #include "debug.h"
 #include "value.h"
+#include "vm.h"
+
+// The printable name of an opcode, or NULL if it isn't one. Shared with the profiler so its reports match the disassembly.
+const char* opcodeName(uint8_t opcode) {
+    switch (opcode) {
+        case OP_CONSTANT: return "OP_CONSTANT";
+        case OP_NIL:      return "OP_NIL";
+        case OP_TRUE:     return "OP_TRUE";
+        case OP_FALSE:    return "OP_FALSE";
+        case OP_EQUAL:    return "OP_EQUAL";
+        case OP_GREATER:  return "OP_GREATER";
+        case OP_LESS:     return "OP_LESS";
+        case OP_ADD:      return "OP_ADD";
+        case OP_SUBTRACT: return "OP_SUBTRACT";
+        case OP_MULTIPLY: return "OP_MULTIPLY";
+        case OP_DIVIDE:   return "OP_DIVIDE";
+        case OP_NOT:      return "OP_NOT";
+        case OP_NEGATE:   return "OP_NEGATE";
+        case OP_RETURN:   return "OP_RETURN";
+        case OP_INPUT:    return "OP_INPUT";
+        case OP_LOAD_R:     return "OP_LOAD_R";
+        case OP_EQUAL_R:    return "OP_EQUAL_R";
+        case OP_GREATER_R:  return "OP_GREATER_R";
+        case OP_LESS_R:     return "OP_LESS_R";
+        case OP_ADD_R:      return "OP_ADD_R";
+        case OP_SUBTRACT_R: return "OP_SUBTRACT_R";
+        case OP_MULTIPLY_R: return "OP_MULTIPLY_R";
+        case OP_DIVIDE_R:   return "OP_DIVIDE_R";
+        case OP_NOT_R:      return "OP_NOT_R";
+        case OP_NEGATE_R:   return "OP_NEGATE_R";
+        case OP_RETURN_R:   return "OP_RETURN_R";
+        default:          return NULL;
+    }
+}
 
 void disassembleChunk(Chunk* chunk, const char* name) {
-    printf("== %s ==\n", name);
+    writeFormat(&vm.out, "== %s ==\n", name);
 
     for (int offset = 0; offset < chunk->count;) {
         offset = disassembleInstruction(chunk, offset); // Increments offset for us
@@ -13,57 +47,92 @@ void disassembleChunk(Chunk* chunk, const char* name) {
 
 static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1]; // Index of constant
-    printf("%-16s %4d '", name, constant); // Print index of constant and the constant
+    writeFormat(&vm.out, "%-16s %4d '", name, constant); // Print index of constant and the constant
     printValue(chunk->constants.values[constant]); 
-    printf("'\n");
+    writeOutput(&vm.out, "'\n", 2);
     return offset + 2; // OP_CONSTANT is 2 bytes (one for the opcode and one for the operand), hence why we increment by 2.
 }
 
+// Prints an RK operand: rN for a register, or kN and the constant's value for a constant
+static void printOperand(Chunk* chunk, uint8_t operand) {
+    if (operand < RK_CONSTANT) {
+        writeFormat(&vm.out, " r%d", operand);
+        return;
+    }
+    writeFormat(&vm.out, " k%d '", operand - RK_CONSTANT);
+    printValue(chunk->constants.values[operand - RK_CONSTANT]);
+    writeOutput(&vm.out, "'", 1);
+}
+
+// Register machine instructions: a destination register (unless hasDestination is false) followed by RK operands
+static int registerInstruction(const char* name, Chunk* chunk, int offset, bool hasDestination, int operandCount) {
+    writeFormat(&vm.out, "%-16s", name);
+    int operand = offset + 1;
+    if (hasDestination) writeFormat(&vm.out, " r%d", chunk->code[operand++]);
+    for (int i = 0; i < operandCount; i++) {
+        printOperand(chunk, chunk->code[operand++]);
+    }
+    writeOutput(&vm.out, "\n", 1);
+    return operand;
+}
+
 static int simpleInstruction(const char* name, int offset) {
-    printf("%s\n", name);
+    writeFormat(&vm.out, "%s\n", name);
     return offset + 1;
 }
 
 int disassembleInstruction(Chunk* chunk, int offset) {
-    printf("%04d ", offset); // Print offset position of instruction
+    writeFormat(&vm.out, "%04d ", offset); // Print offset position of instruction
     if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
-        printf("   | "); // If same line as previous instruction, print this.
+        writeFormat(&vm.out, "   | "); // If same line as previous instruction, print this.
     } else {
-       printf("%4d ", chunk->lines[offset]); // Else, print the line number.
+       writeFormat(&vm.out, "%4d ", chunk->lines[offset]); // Else, print the line number.
     }
 
     uint8_t instruction = chunk->code[offset];
+    const char* name = opcodeName(instruction);
     switch (instruction) {
         case OP_CONSTANT:
-            return constantInstruction("OP_CONSTANT", chunk, offset);
+            return constantInstruction(name, chunk, offset);
         case OP_NIL:
-            return simpleInstruction("OP_NIL", offset);
         case OP_TRUE:
-            return simpleInstruction("OP_TRUE", offset);
         case OP_FALSE:
-            return simpleInstruction("OP_FALSE", offset);
         case OP_EQUAL:
-            return simpleInstruction("OP_EQUAL", offset);
         case OP_GREATER:
-            return simpleInstruction("OP_GREATER", offset);
         case OP_LESS:
-            return simpleInstruction("OP_LESS", offset);
         case OP_ADD:
-            return simpleInstruction("OP_ADD", offset);
         case OP_SUBTRACT:
-            return simpleInstruction("OP_SUBTRACT", offset);
         case OP_MULTIPLY:
-            return simpleInstruction("OP_MULTIPLY", offset);
         case OP_DIVIDE:
-            return simpleInstruction("OP_DIVIDE", offset);
         case OP_NOT:
-            return simpleInstruction("OP_NOT", offset);
         case OP_NEGATE:
-            return simpleInstruction("OP_NEGATE", offset);
         case OP_RETURN:
-            return simpleInstruction("OP_RETURN", offset);
+            return simpleInstruction(name, offset);
+        case OP_INPUT:
+            writeFormat(&vm.out, "%-16s %4d\n", name, chunk->code[offset + 1]);
+            return offset + 2;
+        case OP_LOAD_R: {
+            uint8_t constant = chunk->code[offset + 2];
+            writeFormat(&vm.out, "%-16s r%d k%d '", name, chunk->code[offset + 1], constant);
+            printValue(chunk->constants.values[constant]);
+            writeOutput(&vm.out, "'\n", 2);
+            return offset + 3;
+        }
+        case OP_EQUAL_R:
+        case OP_GREATER_R:
+        case OP_LESS_R:
+        case OP_ADD_R:
+        case OP_SUBTRACT_R:
+        case OP_MULTIPLY_R:
+        case OP_DIVIDE_R:
+            return registerInstruction(name, chunk, offset, true, 2);
+        case OP_NOT_R:
+        case OP_NEGATE_R:
+            return registerInstruction(name, chunk, offset, true, 1);
+        case OP_RETURN_R:
+            return registerInstruction(name, chunk, offset, false, 1);
         default:
-            printf("Unknown opcode %d\n");
+            writeFormat(&vm.out, "Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
\ No newline at end of file
@@ -0,0 +1,212 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "heapprofile.h"
+#include "object.h"
+#include "vm.h"
+
+/*
+  Sampled heap profiler. Every allocation goes through sampleAllocation() (from reallocate() or allocateObjectMemory()),
+  which counts bytes down and takes a sample each time sampleBytes have gone by. So each sample stands for sampleBytes of
+  allocation, and big allocations that cross several thresholds count several times. A sample is attributed to a site:
+  the opcode and source line vm.ip is on while running, or just the phase otherwise, plus what kind of thing was allocated.
+  The live object histogram doesn't need sampling at all, it's a scan of vm.objects when the report is written.
+*/
+
+#define MAX_SITES 1024   // Distinct sites kept. Samples for sites past this go to the overflow count.
+#define TOP_SITES 20     // How many sites the report shows
+#define SIZE_BUCKETS 32  // Live objects by power of two size
+#define OBJ_TYPES (OBJ_STRING + 1) // One past the last ObjType
+
+typedef struct {
+    Phase phase;
+    int line;      // Only meaningful in PHASE_RUN, -1 otherwise
+    int opcode;    // Same
+    int kind;      // ObjType, or ALLOCATION_BUFFER
+    uint64_t samples;
+    uint64_t allocations; // Allocations that got sampled here (a big one can be several samples)
+} Site;
+
+typedef struct {
+    FILE* report;       // stderr unless a path was given
+    size_t sampleBytes;
+    long long countdown; // Bytes until the next sample
+    uint64_t allocations;
+    uint64_t bytes;      // Everything allocated, sampled or not
+    uint64_t overflow;   // Samples that didn't fit in sites
+    Site sites[MAX_SITES];
+    int siteCount;
+} HeapProfile;
+
+static HeapProfile heapProfile;
+static volatile sig_atomic_t dumpRequested = 0;
+
+static const char* phaseNames[PHASE_COUNT] = {"idle", "scan", "compile", "run"};
+
+static const char* kindName(int kind) {
+    if (kind == ALLOCATION_BUFFER) return "buffer";
+    switch ((ObjType)kind) {
+        case OBJ_STRING: return "string";
+    }
+    return "object";
+}
+
+#ifdef SIGUSR1
+static void handleDumpSignal(int signal) {
+    (void)signal;
+    dumpRequested = 1; // Only a flag, the report gets written by checkHeapProfileSignal() outside the handler
+}
+#endif
+
+// Samples roughly every sampleBytes allocated (1 samples everything). Reports go to reportPath, or stderr if it's NULL.
+void startHeapProfile(const char* reportPath, size_t sampleBytes) {
+    memset(&heapProfile, 0, sizeof(heapProfile));
+    heapProfile.report = stderr;
+    if (reportPath != NULL) {
+        heapProfile.report = fopen(reportPath, "w");
+        if (heapProfile.report == NULL) {
+            fprintf(stderr, "Could not open heap profile \"%s\", using stderr.\n", reportPath);
+            heapProfile.report = stderr;
+        }
+    }
+    heapProfile.sampleBytes = sampleBytes < 1 ? 1 : sampleBytes;
+    heapProfile.countdown = (long long)heapProfile.sampleBytes;
+    vm.profileHeap = true;
+
+#ifdef SIGUSR1
+    signal(SIGUSR1, handleDumpSignal); // kill -USR1 for a report without stopping
+#endif
+}
+
+static Site* findSite(Phase phase, int line, int opcode, int kind) {
+    for (int i = 0; i < heapProfile.siteCount; i++) {
+        Site* site = &heapProfile.sites[i];
+        if (site->phase == phase && site->line == line && site->opcode == opcode && site->kind == kind) return site;
+    }
+    if (heapProfile.siteCount == MAX_SITES) return NULL;
+
+    Site* site = &heapProfile.sites[heapProfile.siteCount++];
+    site->phase = phase;
+    site->line = line;
+    site->opcode = opcode;
+    site->kind = kind;
+    site->samples = 0;
+    site->allocations = 0;
+    return site;
+}
+
+void sampleAllocation(size_t size, int kind) {
+    heapProfile.allocations++;
+    heapProfile.bytes += size;
+    heapProfile.countdown -= (long long)size;
+    if (heapProfile.countdown > 0) return; // The cheap path, nearly every time
+
+    uint64_t samples = 0;
+    while (heapProfile.countdown <= 0) {
+        heapProfile.countdown += (long long)heapProfile.sampleBytes;
+        samples++;
+    }
+
+    // Allocations while running always SYNC() first, so vm.ip is just past the opcode doing the allocating
+    Phase phase = vm.phase;
+    int line = -1;
+    int opcode = -1;
+    if (phase == PHASE_RUN && vm.chunk != NULL && vm.ip > vm.chunk->code && vm.ip <= vm.chunk->code + vm.chunk->count) {
+        int offset = (int)(vm.ip - vm.chunk->code) - 1;
+        line = vm.chunk->lines[offset];
+        opcode = vm.chunk->code[offset];
+    }
+
+    Site* site = findSite(phase, line, opcode, kind);
+    if (site == NULL) {
+        heapProfile.overflow += samples;
+        return;
+    }
+    site->samples += samples;
+    site->allocations++;
+}
+
+void checkHeapProfileSignal() {
+    if (!dumpRequested) return;
+    dumpRequested = 0;
+    dumpHeapProfile();
+}
+
+static int compareSites(const void* a, const void* b) {
+    uint64_t left = ((const Site*)a)->samples;
+    uint64_t right = ((const Site*)b)->samples;
+    return left < right ? 1 : left > right ? -1 : 0;
+}
+
+static size_t objectSize(Obj* object) {
+    switch (object->type) {
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*)object;
+            return sizeof(ObjString) + (IS_BORROWED(string) ? 0 : (size_t)string->length + 1);
+        }
+    }
+    return 0;
+}
+
+// Writes the live object histogram and the top sites. Can be called any number of times, each report covers everything so far.
+void dumpHeapProfile() {
+    FILE* out = heapProfile.report;
+    flushOutput(&vm.out); // Keep the report from landing in the middle of program output on a shared terminal
+
+    fprintf(out, "== Heap profile: %llu allocations, %llu bytes, sampled every %zu bytes ==\n",
+            (unsigned long long)heapProfile.allocations, (unsigned long long)heapProfile.bytes, heapProfile.sampleBytes);
+    fprintf(out, "Live heap: %zu bytes (peak %zu)\n", vm.bytesAllocated, vm.peakBytes);
+
+    // Live objects, exact, by type and by size
+    uint64_t typeCounts[OBJ_TYPES] = {0};
+    uint64_t typeBytes[OBJ_TYPES] = {0};
+    uint64_t sizeCounts[SIZE_BUCKETS] = {0};
+    for (int i = 0; i < vm.objects.count; i++) {
+        Obj* object = OBJECT_AT(&vm.objects, i);
+        size_t size = objectSize(object);
+        typeCounts[object->type]++;
+        typeBytes[object->type] += size;
+
+        int bucket = 0;
+        while (bucket < SIZE_BUCKETS - 1 && ((size_t)2 << bucket) <= size) bucket++;
+        sizeCounts[bucket]++;
+    }
+
+    fprintf(out, "Live objects:\n  %-10s %10s %12s\n", "type", "count", "bytes");
+    for (int type = 0; type < OBJ_TYPES; type++) {
+        fprintf(out, "  %-10s %10llu %12llu\n", kindName(type),
+                (unsigned long long)typeCounts[type], (unsigned long long)typeBytes[type]);
+    }
+    fprintf(out, "Live objects by size:\n");
+    for (int bucket = 0; bucket < SIZE_BUCKETS; bucket++) {
+        if (sizeCounts[bucket] == 0) continue;
+        fprintf(out, "  %8zu-%-8zu %10llu\n", bucket == 0 ? (size_t)0 : (size_t)1 << bucket, ((size_t)2 << bucket) - 1,
+                (unsigned long long)sizeCounts[bucket]);
+    }
+
+    // Sites, by estimated bytes. Sorted in a copy so the site table can keep filling up in the same order.
+    Site sorted[MAX_SITES];
+    memcpy(sorted, heapProfile.sites, sizeof(Site) * heapProfile.siteCount);
+    qsort(sorted, heapProfile.siteCount, sizeof(Site), compareSites);
+
+    fprintf(out, "Top allocation sites (estimated bytes):\n  %12s %10s  %s\n", "bytes", "sampled", "site");
+    for (int i = 0; i < heapProfile.siteCount && i < TOP_SITES; i++) {
+        Site* site = &sorted[i];
+        fprintf(out, "  %12llu %10llu  ", (unsigned long long)(site->samples * heapProfile.sampleBytes),
+                (unsigned long long)site->allocations);
+        if (site->line >= 0) {
+            fprintf(out, "line %d %s", site->line, opcodeName((uint8_t)site->opcode));
+        } else {
+            fprintf(out, "%s", phaseNames[site->phase]);
+        }
+        fprintf(out, " %s\n", kindName(site->kind));
+    }
+    if (heapProfile.overflow > 0) {
+        fprintf(out, "  %12llu %10s  (sites past the first %d)\n",
+                (unsigned long long)(heapProfile.overflow * heapProfile.sampleBytes), "", MAX_SITES);
+    }
+    fflush(out);
+}
@@ -0,0 +1,13 @@
+#ifndef clox_heapprofile_h
+#define clox_heapprofile_h
+
+#include "common.h"
+
+#define ALLOCATION_BUFFER -1 // Kind for allocations that aren't objects (arrays, string buffers). Objects use their ObjType.
+
+void startHeapProfile(const char* reportPath, size_t sampleBytes);
+void sampleAllocation(size_t size, int kind);
+void checkHeapProfileSignal();
+void dumpHeapProfile();
+
+#endif
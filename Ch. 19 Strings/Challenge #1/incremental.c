@@ -0,0 +1,358 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+#include "incremental.h"
+#include "memory.h"
+#include "object.h"
+#include "sampler.h"
+#include "vm.h"
+
+void initIncremental(Incremental* incremental) {
+    memset(incremental, 0, sizeof(Incremental));
+    initChunk(&incremental->chunk);
+}
+
+void freeIncremental(Incremental* incremental) {
+    FREE_ARRAY(char, incremental->source, incremental->capacity);
+    FREE_ARRAY(Token, incremental->tokens, incremental->tokenCapacity);
+    FREE_ARRAY(Token, incremental->fresh, incremental->freshCapacity);
+    FREE_ARRAY(int, incremental->map.constants, incremental->mapCapacity);
+    FREE_ARRAY(int, incremental->map.code, incremental->map.codeCapacity);
+    freeChunk(&incremental->chunk);
+    initIncremental(incremental);
+}
+
+static void appendToken(Token** tokens, int* count, int* capacity, Token token) {
+    if (*count == *capacity) {
+        int oldCapacity = *capacity;
+        *capacity = GROW_CAPACITY(oldCapacity);
+        *tokens = GROW_ARRAY(Token, *tokens, oldCapacity, *capacity);
+    }
+    (*tokens)[(*count)++] = token;
+}
+
+// Room for length chars plus the terminator. The tokens move along with the text.
+static void reserveSource(Incremental* incremental, int length) {
+    if (length + 1 <= incremental->capacity) return;
+    int capacity = incremental->capacity;
+    while (capacity < length + 1) capacity = GROW_CAPACITY(capacity);
+
+    // Not GROW_ARRAY, since the tokens need both the old and the new buffer to find their way over
+    char* grown = ALLOCATE(char, capacity);
+    if (incremental->source != NULL) memcpy(grown, incremental->source, incremental->length + 1);
+    for (int i = 0; i < incremental->tokenCount; i++) {
+        Token* token = &incremental->tokens[i];
+        if (token->type != TOKEN_ERROR) token->start = grown + (token->start - incremental->source);
+    }
+    FREE_ARRAY(char, incremental->source, incremental->capacity);
+    incremental->source = grown;
+    incremental->capacity = capacity;
+}
+
+static int countLines(const char* chars, int length) {
+    int lines = 0;
+    for (int i = 0; i < length; i++) {
+        if (chars[i] == '\n') lines++;
+    }
+    return lines;
+}
+
+static void compileTokens(Incremental* incremental) {
+    if (incremental->tokenCount > incremental->mapCapacity) {
+        int oldCapacity = incremental->mapCapacity;
+        while (incremental->mapCapacity < incremental->tokenCount) incremental->mapCapacity = GROW_CAPACITY(incremental->mapCapacity);
+        incremental->map.constants = GROW_ARRAY(int, incremental->map.constants, oldCapacity, incremental->mapCapacity);
+    }
+    freeChunk(&incremental->chunk);
+    incremental->compiled = compileScanned(incremental->source, incremental->tokens, incremental->tokenCount,
+                                           &incremental->chunk, &incremental->map);
+    incremental->last.recompiled = true;
+}
+
+static void scanAll(Incremental* incremental) {
+    initScanner(incremental->source);
+    incremental->tokenCount = 0;
+    incremental->errorTokens = 0;
+    for (;;) {
+        Token token = scanToken();
+        appendToken(&incremental->tokens, &incremental->tokenCount, &incremental->tokenCapacity, token);
+        if (token.type == TOKEN_ERROR) incremental->errorTokens++;
+        if (token.type == TOKEN_EOF) break;
+    }
+    incremental->last.rescanned = incremental->tokenCount;
+}
+
+bool setSource(Incremental* incremental, const char* source, int length) {
+    memset(&incremental->last, 0, sizeof(EditStats));
+    reserveSource(incremental, length);
+    memcpy(incremental->source, source, length);
+    incremental->source[length] = '\0';
+    incremental->length = length;
+    scanAll(incremental);
+    compileTokens(incremental);
+    return incremental->compiled;
+}
+
+// The first token whose end is at or past offset. There always is one, since EOF ends at the end of the source.
+static int findToken(Incremental* incremental, int offset) {
+    int low = 0;
+    int high = incremental->tokenCount - 1;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        Token* token = &incremental->tokens[middle];
+        if (token->start + token->length - incremental->source >= offset) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return low;
+}
+
+/*
+  Swaps the new literal values into the constants the old ones compiled to. Only called when the rescanned tokens
+  line up one for one with the ones they replace, so the code that reads the constants is still right.
+*/
+static void patchConstants(Incremental* incremental, int first, int count) {
+    for (int i = first; i < first + count; i++) {
+        Token* token = &incremental->tokens[i];
+        int constant = incremental->map.constants[i];
+        if (constant < 0 || (token->type != TOKEN_NUMBER && token->type != TOKEN_STRING)) continue;
+
+        Value value = token->type == TOKEN_NUMBER ? NUMBER_VAL(strtod(token->start, NULL))
+                                                  : OBJ_VAL(copyString(token->start + 1, token->length - 2));
+        if (valuesEqual(incremental->chunk.constants.values[constant], value)) continue;
+        incremental->chunk.constants.values[constant] = value;
+        incremental->last.patched++;
+    }
+}
+
+bool editSource(Incremental* incremental, int start, int removed, const char* text, int inserted) {
+    if (incremental->tokenCount == 0 || incremental->errorTokens > 0) {
+        // Error tokens don't point into the source, so there's nothing to line up with. Start over, the edit is probably the fix.
+        int length = incremental->length - removed + inserted;
+        char* edited = ALLOCATE(char, length + 1);
+        memcpy(edited, incremental->source, start);
+        memcpy(edited + start, text, inserted);
+        memcpy(edited + start + inserted, incremental->source + start + removed, incremental->length - start - removed);
+        bool compiled = setSource(incremental, edited, length);
+        FREE_ARRAY(char, edited, length + 1);
+        return compiled;
+    }
+    memset(&incremental->last, 0, sizeof(EditStats));
+
+    // Rescan from one token further back than the first one the edit touches. The scanner looks up to two characters
+    // past a token's end ("1." only takes the '.' if a digit follows), so that token's extent can change too.
+    int first = findToken(incremental, start);
+    if (first > 0) first--;
+    int resume = 0;
+    int line = 1;
+    if (first > 0) {
+        Token* before = &incremental->tokens[first - 1];
+        resume = (int)(before->start + before->length - incremental->source);
+        line = before->line; // A token's line is the one it ends on
+    }
+    int delta = inserted - removed;
+    int lineDelta = countLines(text, inserted) - countLines(incremental->source + start, removed);
+    int oldEnd = start + removed; // Old tokens from here on are the unchanged tail, just moved by delta
+
+    reserveSource(incremental, incremental->length + delta);
+    char* source = incremental->source;
+    memmove(source + start + inserted, source + oldEnd, incremental->length - oldEnd + 1);
+    memcpy(source + start, text, inserted);
+    incremental->length += delta;
+
+    // Scan until a token lands exactly where an old one from the tail now is. From there on the scanner would only
+    // repeat itself, since it never looks behind and its only state is where it is and what line it's on.
+    resumeScanner(source + resume, line);
+    int freshCount = 0;
+    int freshErrors = 0;
+    int next = first; // The old tokens, in old offsets
+    for (;;) {
+        Token token = scanToken();
+        if (token.type != TOKEN_ERROR) {
+            int offset = (int)(token.start - source);
+            while (next < incremental->tokenCount) {
+                int oldOffset = (int)(incremental->tokens[next].start - source);
+                if (oldOffset >= oldEnd && oldOffset + delta >= offset) break;
+                next++;
+            }
+            Token* old = &incremental->tokens[next];
+            if (next < incremental->tokenCount && (int)(old->start - source) + delta == offset &&
+                old->type == token.type && old->length == token.length) break;
+        } else {
+            freshErrors++;
+        }
+        appendToken(&incremental->fresh, &freshCount, &incremental->freshCapacity, token);
+        if (token.type == TOKEN_EOF) { // Only if an error token made us skip past the old EOF
+            next = incremental->tokenCount;
+            break;
+        }
+    }
+
+    // Literal values are the only thing that may differ if the code is to stay as it is
+    bool patchable = incremental->compiled && freshCount == next - first;
+    for (int i = 0; patchable && i < freshCount; i++) {
+        TokenType type = incremental->fresh[i].type;
+        patchable = type == incremental->tokens[first + i].type && type != TOKEN_IDENTIFIER && type != TOKEN_ERROR;
+    }
+
+    // Splice: the new tokens go in where the replaced ones were, and the tail moves over
+    int tail = incremental->tokenCount - next;
+    int count = first + freshCount + tail;
+    if (count > incremental->tokenCapacity) {
+        int oldCapacity = incremental->tokenCapacity;
+        while (incremental->tokenCapacity < count) incremental->tokenCapacity = GROW_CAPACITY(incremental->tokenCapacity);
+        incremental->tokens = GROW_ARRAY(Token, incremental->tokens, oldCapacity, incremental->tokenCapacity);
+    }
+    Token* tokens = incremental->tokens;
+    memmove(tokens + first + freshCount, tokens + next, sizeof(Token) * tail);
+    for (int i = first + freshCount; i < count; i++) {
+        tokens[i].start += delta;
+        tokens[i].line += lineDelta;
+    }
+    memcpy(tokens + first, incremental->fresh, sizeof(Token) * freshCount);
+    incremental->tokenCount = count;
+    incremental->errorTokens += freshErrors;
+    incremental->last.rescanned = freshCount;
+    incremental->last.reused = count - freshCount;
+
+    if (!patchable) {
+        compileTokens(incremental); // Parsing the tokens again is most of what a compile costs, but none of the scanning
+        return incremental->compiled;
+    }
+
+    patchConstants(incremental, first, freshCount);
+    if (lineDelta != 0) { // Runtime errors report lines, so move the ones after the edit
+        Chunk* chunk = &incremental->chunk;
+        for (int i = 0; i < chunk->count; i++) chunk->lines[i] = tokens[incremental->map.code[i]].line;
+    }
+    return true;
+}
+
+bool updateSource(Incremental* incremental, const char* source, int length) {
+    int prefix = 0;
+    int shorter = length < incremental->length ? length : incremental->length;
+    while (prefix < shorter && source[prefix] == incremental->source[prefix]) prefix++;
+    int suffix = 0;
+    while (suffix < shorter - prefix &&
+           source[length - 1 - suffix] == incremental->source[incremental->length - 1 - suffix]) suffix++;
+
+    if (prefix == length && length == incremental->length) {
+        memset(&incremental->last, 0, sizeof(EditStats));
+        incremental->last.reused = incremental->tokenCount;
+        return incremental->compiled;
+    }
+    return editSource(incremental, prefix, incremental->length - prefix - suffix, source + prefix, length - prefix - suffix);
+}
+
+#ifndef _WIN32
+
+#define WATCH_INTERVAL_NS 100000000 // How often to check the file, 100ms
+
+static volatile sig_atomic_t watching;
+
+static void stopWatching(int signal) {
+    (void)signal;
+    watching = 0;
+}
+
+static double now() {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Copied, not mapped like openSource() does, since an editor saving over the file would pull a mapping out from under us
+static char* readWhole(const char* path, int* length) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    char* chars = (char*)malloc(size + 1);
+    if (chars == NULL || size < 0 || fread(chars, 1, size, file) != (size_t)size) {
+        free(chars);
+        fclose(file);
+        return NULL;
+    }
+    fclose(file);
+    chars[size] = '\0';
+    *length = (int)size;
+    return chars;
+}
+
+static void runCompiled(Incremental* incremental) {
+    if (!incremental->compiled) return;
+    runChunk(&incremental->chunk);
+    if (vm.sampleExecution) resolveSamples(&incremental->chunk); // Before an edit moves the code around
+    flushOutput(&vm.out);
+}
+
+int watchFile(const char* path) {
+    struct stat info;
+    int length;
+    char* chars = readWhole(path, &length);
+    if (chars == NULL || stat(path, &info) != 0) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        free(chars);
+        return 74;
+    }
+
+    Incremental incremental;
+    initIncremental(&incremental);
+    setSource(&incremental, chars, length);
+    free(chars);
+    runCompiled(&incremental);
+
+    struct timespec seen = info.st_mtim;
+    off_t seenSize = info.st_size;
+    watching = 1;
+    signal(SIGINT, stopWatching);
+    signal(SIGTERM, stopWatching);
+    while (watching) {
+        struct timespec interval = {0, WATCH_INTERVAL_NS};
+        nanosleep(&interval, NULL);
+        if (stat(path, &info) != 0) continue; // Mid-save, probably
+        if (info.st_mtim.tv_sec == seen.tv_sec && info.st_mtim.tv_nsec == seen.tv_nsec && info.st_size == seenSize) continue;
+        seen = info.st_mtim;
+        seenSize = info.st_size;
+
+        chars = readWhole(path, &length);
+        if (chars == NULL) continue;
+        double start = now();
+        updateSource(&incremental, chars, length);
+        double seconds = now() - start;
+        free(chars);
+
+        EditStats* last = &incremental.last;
+        fprintf(stderr, "[%s: %d tokens rescanned, %d reused, ", path, last->rescanned, last->reused);
+        if (last->recompiled) {
+            fprintf(stderr, "recompiled");
+        } else {
+            fprintf(stderr, "%d constant%s patched", last->patched, last->patched == 1 ? "" : "s");
+        }
+        fprintf(stderr, " in %.1f us]\n", seconds * 1e6);
+        runCompiled(&incremental);
+    }
+
+    freeIncremental(&incremental);
+    return 0;
+}
+
+#else
+
+int watchFile(const char* path) {
+    (void)path;
+    fprintf(stderr, "Watching isn't supported on this platform.\n");
+    return 64;
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef clox_incremental_h
+#define clox_incremental_h
+
+#include "chunk.h"
+#include "common.h"
+#include "compiler.h"
+
+/*
+  A source kept compiled across edits, for editors and --watch. It holds on to the tokens and remembers which token
+  each constant and byte of code came from. An edit rescans from the token before it until the new tokens line up
+  with the old ones again, then splices the old ones back in after. If only literal values changed (the usual tweak
+  of a number or a string), their constants are patched in place and the code is kept. Anything else is parsed again
+  from the tokens, without scanning the rest of the file.
+*/
+
+typedef struct {
+    int rescanned;   // Tokens scanned again
+    int reused;      // Tokens kept from before the edit
+    int patched;     // Constants replaced in place
+    bool recompiled; // The code had to be compiled again
+} EditStats;
+
+typedef struct {
+    char* source;      // Null terminated. Tokens point into it.
+    int length;
+    int capacity;
+    Token* tokens;     // Always ends with TOKEN_EOF
+    int tokenCount;
+    int tokenCapacity;
+    int errorTokens;   // Their start points at a message, not the source, so edits rescan everything while there are any
+    Token* fresh;      // Scratch space for the tokens an edit rescans
+    int freshCapacity;
+    TokenMap map;
+    int mapCapacity;   // Tokens map.constants has room for
+    Chunk chunk;       // Never frozen, so it can be patched
+    bool compiled;     // chunk is the current source's code. False after a compile error.
+    EditStats last;
+} Incremental;
+
+void initIncremental(Incremental* incremental);
+bool setSource(Incremental* incremental, const char* source, int length); // Scans and compiles it all
+bool editSource(Incremental* incremental, int start, int removed, const char* text, int inserted);
+bool updateSource(Incremental* incremental, const char* source, int length); // Edits whatever differs from the current source
+void freeIncremental(Incremental* incremental);
+
+int watchFile(const char* path); // Runs the file, then again after each change to it until interrupted. Returns the exit code.
+
+#endif
@@ -0,0 +1,182 @@
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "intern.h"
+#include "memory.h"
+
+#ifndef _WIN32
+#define LOCK(shard)   pthread_mutex_lock(&(shard)->lock)
+#define UNLOCK(shard) pthread_mutex_unlock(&(shard)->lock)
+#else
+#define LOCK(shard)   ((void)0) // Nothing runs on more than one thread here
+#define UNLOCK(shard) ((void)0)
+#endif
+
+typedef struct {
+    uint32_t hash;
+    _Atomic(ObjString*) string; // NULL when the slot is empty. Set last, so a reader that sees it also sees hash.
+} Entry;
+
+typedef struct Table {
+    int capacity;           // A power of 2
+    struct Table* replaced; // The one this grew from. Readers might still be in it, and like the strings, it's kept for good.
+    Entry entries[];        // Open addressing with linear probing, never more than half full
+} Table;
+
+typedef struct {
+#ifndef _WIN32
+    pthread_mutex_t lock;  // Only adding takes it. Lookups never do.
+#endif
+    _Atomic(Table*) table; // NULL until the first string
+    int count;
+    size_t bytes;
+} Shard;
+
+typedef union {
+    Shard shard;
+    char line[128]; // Keeps shards on separate cache lines (two, for the adjacent line prefetcher), so adding to one doesn't slow down lookups in another
+} PaddedShard;
+
+static PaddedShard shards[INTERN_SHARDS];
+static _Atomic uint64_t sharedLengths[INTERN_MAX_LENGTH / 64 + 1]; // Bit n is set once there's a shared string n chars long
+
+// Most strings made at runtime are a length no shared string has, and this saves hashing them
+static bool lengthShared(int length) {
+    return (atomic_load_explicit(&sharedLengths[length / 64], memory_order_relaxed) >> (length % 64)) & 1;
+}
+
+#ifndef _WIN32
+static pthread_once_t initialized = PTHREAD_ONCE_INIT;
+
+static void initShards() {
+    for (int i = 0; i < INTERN_SHARDS; i++) pthread_mutex_init(&shards[i].shard.lock, NULL);
+}
+#endif
+
+// Also picks the shard (low bits) and the first slot in it (the rest), so it has to spread well. takeString() hashes
+// everything it makes, so it has to be quick too: 8 bytes per multiply, instead of FNV-1a's one.
+uint32_t hashString(const char* chars, int length) {
+    uint64_t hash = 0x9e3779b97f4a7c15u ^ (uint64_t)length;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, chars, 8); // Unaligned load, the compiler makes it one instruction
+        hash = (hash ^ word) * 0xff51afd7ed558ccdu;
+        hash ^= hash >> 32;
+        chars += 8;
+        length -= 8;
+    }
+    if (length > 0) {
+        uint64_t word = 0;
+        memcpy(&word, chars, (size_t)length);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdu;
+    }
+    hash ^= hash >> 29; // Every input bit has to reach the low bits, which pick the shard
+    hash *= 0xc4ceb9fe1a85ec53u;
+    hash ^= hash >> 32;
+    return (uint32_t)hash;
+}
+
+static Shard* shardFor(uint32_t hash) {
+#ifndef _WIN32
+    pthread_once(&initialized, initShards);
+#endif
+    return &shards[hash & (INTERN_SHARDS - 1)].shard;
+}
+
+/*
+  Safe without the lock: slots only ever go from empty to holding a string, strings never change, and a table is
+  never written again once it's been replaced. The worst a reader racing a writer can do is miss a string that's
+  just being added, which callers treat like it not being there yet.
+*/
+static ObjString* lookup(Table* table, const char* chars, int length, uint32_t hash) {
+    if (table == NULL) return NULL;
+    uint32_t mask = (uint32_t)(table->capacity - 1);
+    for (uint32_t index = (hash / INTERN_SHARDS) & mask;; index = (index + 1) & mask) {
+        Entry* entry = &table->entries[index];
+        ObjString* string = atomic_load_explicit(&entry->string, memory_order_acquire);
+        if (string == NULL) return NULL;
+        if (entry->hash == hash && string->length == length && memcmp(string->chars, chars, length) == 0) return string;
+    }
+}
+
+// Only with the shard locked, for a string that isn't in the table yet
+static void insert(Table* table, ObjString* string, uint32_t hash) {
+    uint32_t mask = (uint32_t)(table->capacity - 1);
+    uint32_t index = (hash / INTERN_SHARDS) & mask;
+    while (atomic_load_explicit(&table->entries[index].string, memory_order_relaxed) != NULL) index = (index + 1) & mask;
+    table->entries[index].hash = hash;
+    atomic_store_explicit(&table->entries[index].string, string, memory_order_release);
+}
+
+// Copies the shard's table into one twice the size, then lets readers at it. Only with the shard locked.
+static Table* growShard(Shard* shard) {
+    Table* old = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    int capacity = old == NULL ? 64 : old->capacity * 2;
+    Table* table = (Table*)allocateImmortal(sizeof(Table) + sizeof(Entry) * (size_t)capacity); // Zeroed, it's never been used
+    table->capacity = capacity;
+    table->replaced = old;
+    for (int i = 0; old != NULL && i < old->capacity; i++) {
+        ObjString* string = atomic_load_explicit(&old->entries[i].string, memory_order_relaxed);
+        if (string != NULL) insert(table, string, old->entries[i].hash);
+    }
+    atomic_store_explicit(&shard->table, table, memory_order_release);
+    return table;
+}
+
+static ObjString* newSharedString(const char* chars, int length) {
+    ObjString* string = (ObjString*)allocateImmortal(sizeof(ObjString) + length + 1);
+    string->obj.type = OBJ_STRING;
+    string->obj.shared = true;
+    string->length = length;
+    string->chars = string->inlineChars;
+    memcpy(string->inlineChars, chars, length);
+    string->inlineChars[length] = '\0';
+    return string;
+}
+
+ObjString* internString(const char* chars, int length) {
+    if (length > INTERN_MAX_LENGTH) return NULL;
+    uint32_t hash = hashString(chars, length);
+    Shard* shard = shardFor(hash);
+    ObjString* string = lookup(atomic_load_explicit(&shard->table, memory_order_acquire), chars, length, hash);
+    if (string != NULL) return string;
+
+    size_t size = sizeof(ObjString) + length + 1;
+    LOCK(shard);
+    Table* table = atomic_load_explicit(&shard->table, memory_order_relaxed);
+    string = lookup(table, chars, length, hash); // Someone might have added it since we looked
+    if (string == NULL && shard->bytes + size <= INTERN_SHARD_BYTES) {
+        if (table == NULL || (shard->count + 1) * 2 > table->capacity) table = growShard(shard);
+        string = newSharedString(chars, length);
+        atomic_fetch_or_explicit(&sharedLengths[length / 64], (uint64_t)1 << (length % 64), memory_order_relaxed);
+        insert(table, string, hash);
+        shard->count++;
+        shard->bytes += size;
+    }
+    UNLOCK(shard);
+    return string;
+}
+
+ObjString* findInterned(const char* chars, int length) {
+    if (length > INTERN_MAX_LENGTH || !lengthShared(length)) return NULL;
+    uint32_t hash = hashString(chars, length);
+    return lookup(atomic_load_explicit(&shardFor(hash)->table, memory_order_acquire), chars, length, hash);
+}
+
+InternStats internStats() {
+    InternStats stats = {0, 0};
+    for (int i = 0; i < INTERN_SHARDS; i++) {
+        Shard* shard = shardFor((uint32_t)i);
+        LOCK(shard);
+        stats.strings += shard->count;
+        stats.bytes += shard->bytes;
+        UNLOCK(shard);
+    }
+    return stats;
+}
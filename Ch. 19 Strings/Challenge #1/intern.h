@@ -0,0 +1,31 @@
+#ifndef clox_intern_h
+#define clox_intern_h
+
+#include "common.h"
+#include "object.h"
+
+/*
+  Process-wide table of shared strings. copyString() and the compiler put literals here, so every literal with the same
+  chars is the same ObjString, whichever thread or VM compiled it. takeString() only looks, so strings made at runtime
+  don't add to it. Neither do literals while vm.internLiterals is off, which the server does for each request: nothing
+  frees a shared string, or counts it toward --max-heap, so a request's literals have to live and die with it. Shared strings are immutable and immortal: they're never on a VM's object table, so nothing a VM frees can
+  take one away from another.
+  Lookups don't lock. Adding does, but the table is split into INTERN_SHARDS shards by hash, each with its own lock, so
+  threads compiling at once only wait on each other when they add to the same shard at the same time.
+*/
+
+#define INTERN_SHARDS 64                 // A power of 2
+#define INTERN_MAX_LENGTH 256            // Longer strings aren't shared. They're rarely repeated, and never identifiers.
+#define INTERN_SHARD_BYTES (1024 * 1024) // Once a shard holds this many bytes of strings, it only hands out what it has
+
+typedef struct {
+    long strings;
+    size_t bytes;
+} InternStats;
+
+uint32_t hashString(const char* chars, int length);
+ObjString* internString(const char* chars, int length); // The shared string, made if needed. NULL if it can't be shared.
+ObjString* findInterned(const char* chars, int length); // The shared string if there is one, otherwise NULL
+InternStats internStats();
+
+#endif
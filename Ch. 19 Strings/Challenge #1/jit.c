@@ -0,0 +1,322 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+
+/*
+  A template JIT: every opcode has a fixed snippet of x86-64 machine code, and a chunk is compiled by gluing the snippets together.
+  Only built for x86-64 with the System V calling convention, and with 16 byte Values (not OBJECT_COMPRESSION).
+  Everywhere else compileJit() just says no and run() handles everything.
+
+  Register use in the generated code:
+    rbx  The stack pointer (same meaning as vm.stackTop). Callee-saved, so it survives calls into C.
+    rax  Scratch, and the return value of the whole function (an InterpretResult)
+    xmm0 Scratch for number math
+
+  Numbers take an inline fast path. Anything else calls a C helper, which gets the stack pointer and the instruction's offset
+  (for runtime errors), and returns the new stack pointer, or NULL after reporting a runtime error.
+*/
+
+#if defined(__x86_64__) && !defined(_WIN32) && !defined(OBJECT_COMPRESSION)
+
+#include <sys/mman.h>
+
+#define MAX_TEMPLATE_SIZE 96 // Longest snippet any opcode can produce, with room to spare
+
+_Static_assert(sizeof(Value) == 16, "The templates assume 16 byte Values");
+
+#define TYPE_OFFSET ((int)offsetof(Value, type))
+#define AS_OFFSET ((int)offsetof(Value, as))
+
+typedef struct {
+    uint8_t* code;
+    size_t count;
+    size_t capacity;
+    size_t* errorJumps; // Positions of rel32 operands that need to point at the error exit
+    int errorJumpCount;
+    Chunk* chunk;
+} Assembler;
+
+// ---- Helpers the generated code calls ----
+
+// Points vm.ip just past the instruction, like run() does, so runtimeError() finds the right line
+static void setLocation(Value* sp, int offset) {
+    vm.ip = vm.chunk->code + offset + 1;
+    vm.stackTop = sp;
+}
+
+static Value* jitAdd(Value* sp, int offset) {
+    setLocation(sp, offset);
+    Value a = sp[-2];
+    Value b = sp[-1];
+    if (IS_STRING(a) && IS_STRING(b)) {
+        sp[-2] = OBJ_VAL(concatenate(AS_STRING(a), AS_STRING(b)));
+        return sp - 1;
+    }
+    runtimeError("Operands must be two numbers or two strings."); // The inline path already handled numbers
+    return NULL;
+}
+
+static Value* jitNumbersError(Value* sp, int offset) {
+    setLocation(sp, offset);
+    runtimeError("Operands must be numbers.");
+    return NULL;
+}
+
+static Value* jitNegateError(Value* sp, int offset) {
+    setLocation(sp, offset);
+    runtimeError("Operand must be a number.");
+    return NULL;
+}
+
+static Value* jitEqual(Value* sp, int offset) {
+    (void)offset;
+    sp[-2] = BOOL_VAL(valuesEqual(sp[-2], sp[-1]));
+    return sp - 1;
+}
+
+static Value* jitReturn(Value* sp, int offset) {
+    setLocation(sp - 1, offset);
+    if (vm.result != NULL) {
+        *vm.result = sp[-1];
+        return sp - 1;
+    }
+    printValue(sp[-1]);
+    writeOutput(&vm.out, "\n", 1);
+    return sp - 1;
+}
+
+// ---- Emitting bytes ----
+
+static void emit8(Assembler* as, uint8_t byte) {
+    as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler* as, uint32_t value) {
+    memcpy(as->code + as->count, &value, 4);
+    as->count += 4;
+}
+
+static void emit64(Assembler* as, uint64_t value) {
+    memcpy(as->code + as->count, &value, 8);
+    as->count += 8;
+}
+
+static void emitBytes(Assembler* as, const uint8_t* bytes, size_t count) {
+    memcpy(as->code + as->count, bytes, count);
+    as->count += count;
+}
+
+// Emits a 32 bit jump offset to be filled in later, and returns where it is
+static size_t emitJumpSlot(Assembler* as) {
+    size_t slot = as->count;
+    emit32(as, 0);
+    return slot;
+}
+
+static void patchJump(Assembler* as, size_t slot, size_t target) {
+    uint32_t relative = (uint32_t)(target - (slot + 4));
+    memcpy(as->code + slot, &relative, 4);
+}
+
+// cmp dword [rbx + displacement], type
+static void emitCheckType(Assembler* as, int displacement, ValueType type) {
+    uint8_t bytes[] = {0x83, 0x7b, (uint8_t)displacement, (uint8_t)type};
+    emitBytes(as, bytes, sizeof(bytes));
+}
+
+// Pushes a Value that's known at compile time
+static void emitPushValue(Assembler* as, Value value) {
+    uint64_t payload = 0;
+    memcpy(&payload, (uint8_t*)&value + AS_OFFSET, sizeof(payload));
+
+    emit8(as, 0xc7); emit8(as, 0x43); emit8(as, TYPE_OFFSET); emit32(as, value.type); // mov dword [rbx + type], type
+    emit8(as, 0x48); emit8(as, 0xb8); emit64(as, payload);                            // mov rax, payload
+    emit8(as, 0x48); emit8(as, 0x89); emit8(as, 0x43); emit8(as, AS_OFFSET);           // mov [rbx + as], rax
+    emit8(as, 0x48); emit8(as, 0x83); emit8(as, 0xc3); emit8(as, sizeof(Value));       // add rbx, 16
+}
+
+// Calls helper(rbx, offset) and takes the stack pointer it returns. NULL means a runtime error, so bail out.
+static void emitCallHelper(Assembler* as, Value* (*helper)(Value*, int), int offset) {
+    emit8(as, 0x48); emit8(as, 0x89); emit8(as, 0xdf);        // mov rdi, rbx
+    emit8(as, 0xbe); emit32(as, (uint32_t)offset);             // mov esi, offset
+    emit8(as, 0x48); emit8(as, 0xb8); emit64(as, (uint64_t)(uintptr_t)helper); // mov rax, helper
+    emit8(as, 0xff); emit8(as, 0xd0);                         // call rax
+    emit8(as, 0x48); emit8(as, 0x85); emit8(as, 0xc0);        // test rax, rax
+    emit8(as, 0x0f); emit8(as, 0x84);                         // jz errorExit
+    as->errorJumps[as->errorJumpCount++] = emitJumpSlot(as);
+    emit8(as, 0x48); emit8(as, 0x89); emit8(as, 0xc3);        // mov rbx, rax
+}
+
+/*
+  Binary operators on numbers. Both operands have to be numbers or it's off to the slow helper.
+  sseOp is the second opcode byte of the scalar double instruction (addsd 58, subsd 5c, mulsd 59, divsd 5e).
+  For comparisons, sseOp is 0 and compareSwapped says whether to compare b > a (for <) instead of a > b.
+*/
+static void emitBinary(Assembler* as, uint8_t sseOp, bool compare, bool compareSwapped, Value* (*slow)(Value*, int), int offset) {
+    const int a = -2 * (int)sizeof(Value);
+    const int b = -(int)sizeof(Value);
+
+    emitCheckType(as, b + TYPE_OFFSET, VAL_NUMBER);
+    emit8(as, 0x0f); emit8(as, 0x85); size_t notNumberB = emitJumpSlot(as); // jne slow
+    emitCheckType(as, a + TYPE_OFFSET, VAL_NUMBER);
+    emit8(as, 0x0f); emit8(as, 0x85); size_t notNumberA = emitJumpSlot(as); // jne slow
+
+    if (!compare) {
+        uint8_t bytes[] = {
+            0xf2, 0x0f, 0x10, 0x43, (uint8_t)(a + AS_OFFSET), // movsd xmm0, [a]
+            0xf2, 0x0f, sseOp, 0x43, (uint8_t)(b + AS_OFFSET), // op xmm0, [b]
+            0xf2, 0x0f, 0x11, 0x43, (uint8_t)(a + AS_OFFSET), // movsd [a], xmm0
+        };
+        emitBytes(as, bytes, sizeof(bytes));
+    } else {
+        int left = compareSwapped ? b : a;
+        int right = compareSwapped ? a : b;
+        uint8_t bytes[] = {
+            0xf2, 0x0f, 0x10, 0x43, (uint8_t)(left + AS_OFFSET),  // movsd xmm0, [left]
+            0x66, 0x0f, 0x2e, 0x43, (uint8_t)(right + AS_OFFSET), // ucomisd xmm0, [right]
+            0x0f, 0x97, 0xc0,                                    // seta al (false for NaN, like C)
+            0xc7, 0x43, (uint8_t)(a + TYPE_OFFSET),              // mov dword [a + type], VAL_BOOL
+        };
+        emitBytes(as, bytes, sizeof(bytes));
+        emit32(as, VAL_BOOL);
+        emit8(as, 0x88); emit8(as, 0x43); emit8(as, (uint8_t)(a + AS_OFFSET)); // mov byte [a + as], al
+    }
+    emit8(as, 0x48); emit8(as, 0x83); emit8(as, 0xeb); emit8(as, sizeof(Value)); // sub rbx, 16
+    emit8(as, 0xe9); size_t done = emitJumpSlot(as);                             // jmp done
+
+    patchJump(as, notNumberA, as->count);
+    patchJump(as, notNumberB, as->count);
+    emitCallHelper(as, slow, offset);
+    patchJump(as, done, as->count);
+}
+
+static void emitNegate(Assembler* as, int offset) {
+    const int top = -(int)sizeof(Value);
+    emitCheckType(as, top + TYPE_OFFSET, VAL_NUMBER);
+    emit8(as, 0x0f); emit8(as, 0x85); size_t notNumber = emitJumpSlot(as);      // jne slow
+    emit8(as, 0x48); emit8(as, 0xb8); emit64(as, 0x8000000000000000ull);         // mov rax, sign bit
+    emit8(as, 0x48); emit8(as, 0x31); emit8(as, 0x43); emit8(as, (uint8_t)(top + AS_OFFSET)); // xor [top + as], rax
+    emit8(as, 0xe9); size_t done = emitJumpSlot(as);                             // jmp done
+
+    patchJump(as, notNumber, as->count);
+    emitCallHelper(as, jitNegateError, offset);
+    patchJump(as, done, as->count);
+}
+
+// isFalsey() without branches: nil, or a bool whose byte is 0
+static void emitNot(Assembler* as) {
+    const int top = -(int)sizeof(Value);
+    emitCheckType(as, top + TYPE_OFFSET, VAL_NIL);
+    emit8(as, 0x0f); emit8(as, 0x94); emit8(as, 0xc1);                          // sete cl
+    emitCheckType(as, top + TYPE_OFFSET, VAL_BOOL);
+    emit8(as, 0x0f); emit8(as, 0x94); emit8(as, 0xc2);                          // sete dl
+    emit8(as, 0x80); emit8(as, 0x7b); emit8(as, (uint8_t)(top + AS_OFFSET)); emit8(as, 0x00); // cmp byte [top + as], 0
+    emit8(as, 0x0f); emit8(as, 0x94); emit8(as, 0xc0);                          // sete al
+    emit8(as, 0x20); emit8(as, 0xd0);                                           // and al, dl
+    emit8(as, 0x08); emit8(as, 0xc8);                                           // or al, cl
+    emit8(as, 0xc7); emit8(as, 0x43); emit8(as, (uint8_t)(top + TYPE_OFFSET)); emit32(as, VAL_BOOL); // mov dword [top + type], VAL_BOOL
+    emit8(as, 0x88); emit8(as, 0x43); emit8(as, (uint8_t)(top + AS_OFFSET));    // mov byte [top + as], al
+}
+
+// Leaves the generated function with result in eax
+static void emitExit(Assembler* as, InterpretResult result) {
+    emit8(as, 0xb8); emit32(as, result); // mov eax, result
+    emit8(as, 0x5b);                     // pop rbx
+    emit8(as, 0xc3);                     // ret
+}
+
+// Emits one instruction and returns the offset of the next, or -1 for anything the templates don't cover
+static int emitInstruction(Assembler* as, int offset) {
+    Chunk* chunk = as->chunk;
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT: emitPushValue(as, chunk->constants.values[chunk->code[offset + 1]]); return offset + 2;
+        case OP_NIL:      emitPushValue(as, NIL_VAL); return offset + 1;
+        case OP_TRUE:     emitPushValue(as, BOOL_VAL(true)); return offset + 1;
+        case OP_FALSE:    emitPushValue(as, BOOL_VAL(false)); return offset + 1;
+        case OP_EQUAL:    emitCallHelper(as, jitEqual, offset); return offset + 1;
+        case OP_GREATER:  emitBinary(as, 0, true, false, jitNumbersError, offset); return offset + 1;
+        case OP_LESS:     emitBinary(as, 0, true, true, jitNumbersError, offset); return offset + 1;
+        case OP_ADD:      emitBinary(as, 0x58, false, false, jitAdd, offset); return offset + 1;
+        case OP_SUBTRACT: emitBinary(as, 0x5c, false, false, jitNumbersError, offset); return offset + 1;
+        case OP_MULTIPLY: emitBinary(as, 0x59, false, false, jitNumbersError, offset); return offset + 1;
+        case OP_DIVIDE:   emitBinary(as, 0x5e, false, false, jitNumbersError, offset); return offset + 1;
+        case OP_NOT:      emitNot(as); return offset + 1;
+        case OP_NEGATE:   emitNegate(as, offset); return offset + 1;
+        case OP_RETURN:
+            emitCallHelper(as, jitReturn, offset);
+            emitExit(as, INTERPRET_OK);
+            return offset + 1;
+        default:
+            return -1; // Register machine code and anything newer stays in the interpreter
+    }
+}
+
+// Compiles chunk to native code. Returns false if it can't, and the caller should interpret it instead.
+bool compileJit(Chunk* chunk, JitCode* jit) {
+    Assembler as;
+    as.chunk = chunk;
+    as.count = 0;
+    as.capacity = (size_t)chunk->count * MAX_TEMPLATE_SIZE + MAX_TEMPLATE_SIZE;
+    as.errorJumpCount = 0;
+    as.errorJumps = ALLOCATE(size_t, chunk->count);
+
+    // W^X: the code is written while the pages are read/write, and only made executable once it's done
+    as.code = (uint8_t*)mmap(NULL, as.capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (as.code == MAP_FAILED) {
+        FREE_ARRAY(size_t, as.errorJumps, chunk->count);
+        return false;
+    }
+
+    emit8(&as, 0x53);                                // push rbx (also lines the stack up to 16 bytes for calls)
+    emit8(&as, 0x48); emit8(&as, 0x89); emit8(&as, 0xfb); // mov rbx, rdi
+
+    bool compiled = true;
+    for (int offset = 0; offset < chunk->count;) {
+        offset = emitInstruction(&as, offset);
+        if (offset < 0) {
+            compiled = false;
+            break;
+        }
+    }
+
+    if (compiled) {
+        size_t errorExit = as.count;
+        emitExit(&as, INTERPRET_RUNTIME_ERROR);
+        for (int i = 0; i < as.errorJumpCount; i++) patchJump(&as, as.errorJumps[i], errorExit);
+        compiled = mprotect(as.code, as.capacity, PROT_READ | PROT_EXEC) == 0;
+    }
+
+    FREE_ARRAY(size_t, as.errorJumps, chunk->count);
+    if (!compiled) {
+        munmap(as.code, as.capacity);
+        return false;
+    }
+
+    jit->code = as.code;
+    jit->size = as.capacity;
+    jit->function = (JitFunction)(uintptr_t)as.code;
+    return true;
+}
+
+void freeJit(JitCode* jit) {
+    munmap(jit->code, jit->size);
+    jit->code = NULL;
+    jit->function = NULL;
+}
+
+#else
+
+bool compileJit(Chunk* chunk, JitCode* jit) {
+    (void)chunk;
+    (void)jit;
+    return false;
+}
+
+void freeJit(JitCode* jit) {
+    (void)jit;
+}
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "chunk.h"
+#include "vm.h"
+
+#define JIT_THRESHOLD 64 // Default minimum chunk size in bytes. Smaller chunks finish faster in run() than it takes to map memory for them.
+
+typedef InterpretResult (*JitFunction)(Value* stackTop);
+
+typedef struct {
+    void* code;  // Executable memory, never writable at the same time
+    size_t size;
+    JitFunction function;
+} JitCode; // Native code for one chunk
+
+bool compileJit(Chunk* chunk, JitCode* jit);
+void freeJit(JitCode* jit);
+
+#endif
@@ -3,73 +3,303 @@
 #include <string.h>
 
 #include "common.h"
+#include "aot.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "heapprofile.h"
+#include "incremental.h"
+#include "intern.h"
+#include "memo.h"
+#include "pipeline.h"
+#include "prefork.h"
+#include "profile.h"
+#include "sampler.h"
+#include "scheduler.h"
+#include "server.h"
 #include "vm.h"
 
 static void repl() {
-    char line[1024];
+    Line line;
+    initLine(&line);
     for (;;) {
-        printf("> ");
+        writeOutput(&vm.out, "> ", 2);
+        flushOutput(&vm.out); // Show the prompt (and the last result) before blocking on input
 
-        if (!fgets(line, sizeof(line), stdin)) {
-            printf("\n");
+        if (!readLine(stdin, &line)) {
+            writeOutput(&vm.out, "\n", 1);
             break;
         }
 
-        interpret(line);
+        interpret(line.chars);
     }
+    freeLine(&line);
 }
 
-static char* readFile(const char* path) {
-    FILE* file = fopen(path, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
+// Returns the exit code, so main() still gets to call freeVM() (and write out any reports) on errors
+static int runFile(const char* path) {
+    Source* source = openSource(path); // Maps the file instead of copying it, when it can
+    InterpretResult result = interpretSource(source);
+    releaseSource(source);
+
+    if (result == INTERPRET_OK) return 0;
+    if (result == INTERPRET_COMPILE_ERROR) return 65;
+    return 70; // Runtime errors, and running out of any of vm.limits
+}
+
+// For --stats, so limits can be sized from real numbers
+static void printUsage() {
+    flushOutput(&vm.out); // So the program's output comes before the report when both go to the same place
+    if (hasLimits()) {
+        fprintf(stderr, "instructions: %ld (peak %ld)\n", vm.usage.instructions, vm.usage.peakInstructions);
+    } else {
+        fprintf(stderr, "instructions: not metered (only counted under a --max-* or --timeout limit)\n");
     }
+    fprintf(stderr, "heap growth:  %zu bytes (peak %zu, live %zu, process peak %zu)\n",
+            vm.usage.heapBytes, vm.usage.peakHeapBytes, vm.bytesAllocated, vm.peakBytes);
+    fprintf(stderr, "time:         %.6f s (peak %.6f)\n", vm.usage.seconds, vm.usage.peakSeconds);
+    fprintf(stderr, "objects:      %d live in %d segments\n", vm.objects.count, vm.objects.segmentCount);
+    InternStats interned = internStats();
+    fprintf(stderr, "shared:       %ld strings, %zu bytes\n", interned.strings, interned.bytes);
+    if (vm.memoize) {
+        MemoStats memo = memoStats();
+        long hits = memo.sourceHits + memo.codeHits;
+        fprintf(stderr, "memo:         %ld of %ld hit (%.1f%%: %ld by source, %ld by bytecode), %ld stored, %ld evicted, %ld impure\n",
+                hits, memo.lookups, memo.lookups > 0 ? 100.0 * hits / memo.lookups : 0.0, memo.sourceHits, memo.codeHits,
+                memo.stores, memo.evictions, memo.impure);
+    }
+}
 
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
+// For --phases: where interpret() spent its time, and what the hardware counters saw in each phase
+static void printPhases() {
+    static const Phase order[] = {PHASE_SCAN, PHASE_COMPILE, PHASE_RUN, PHASE_IDLE};
+    static const char* names[PHASE_COUNT] = {"other", "scan", "compile", "run"};
+    PhaseStats* stats = &vm.phaseStats;
+    flushOutput(&vm.out);
 
-    char* buffer = (char*)malloc(fileSize + 1); // +1 for null terminator
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
+    double total = 0;
+    bool counters = false;
+    for (int i = 0; i < PHASE_COUNT; i++) total += stats->phases[i].seconds;
+    for (int i = 0; i < COUNTER_COUNT; i++) counters = counters || hasCounter((Counter)i);
+
+    fprintf(stderr, "%-8s %12s %7s", "phase", "seconds", "share");
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        if (hasCounter((Counter)i)) fprintf(stderr, " %14s", counterNames[i]);
     }
+    fprintf(stderr, counters && hasCounter(COUNTER_CYCLES) && hasCounter(COUNTER_INSTRUCTIONS) ? " %6s\n" : "\n", "IPC");
 
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74);
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        PhaseCost* cost = &stats->phases[order[i]];
+        fprintf(stderr, "%-8s %12.6f %6.1f%%", names[order[i]], cost->seconds, total > 0 ? cost->seconds / total * 100 : 0);
+        for (int j = 0; j < COUNTER_COUNT; j++) {
+            if (hasCounter((Counter)j)) fprintf(stderr, " %14llu", (unsigned long long)cost->counters[j]);
+        }
+        if (hasCounter(COUNTER_CYCLES) && hasCounter(COUNTER_INSTRUCTIONS)) {
+            uint64_t cycles = cost->counters[COUNTER_CYCLES];
+            fprintf(stderr, " %6.2f", cycles > 0 ? (double)cost->counters[COUNTER_INSTRUCTIONS] / cycles : 0);
+        }
+        fprintf(stderr, "\n");
     }
+    fprintf(stderr, "%ld calls, %.6f s", stats->calls, total);
+    fprintf(stderr, counters ? "\n" : ", hardware counters unavailable\n");
+}
 
-    buffer[bytesRead] = '\0';
+// Compiles the script and writes it out as C instead of running it. "-" (or no output path) means stdout.
+static int emitFile(const char* path, const char* outputPath) {
+    Source* source = openSource(path);
+    Chunk chunk;
+    initChunk(&chunk);
+
+    int status = 0;
+    if (!compile(source->chars, &chunk)) {
+        status = 65;
+    } else {
+        FILE* file = strcmp(outputPath, "-") == 0 ? stdout : fopen(outputPath, "w");
+        if (file == NULL) {
+            fprintf(stderr, "Could not open file \"%s\".\n", outputPath);
+            status = 74;
+        } else {
+            if (!emitC(&chunk, path, file)) {
+                fprintf(stderr, "--emit-c only handles stack code, drop --registers.\n");
+                status = 64;
+            }
+            if (file != stdout) fclose(file);
+        }
+    }
 
-    fclose(file);
-    return buffer;
+    freeChunk(&chunk);
+    releaseSource(source);
+    return status;
 }
 
-static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+// Runs several files at once as green threads, each at the priority given before it on the command line
+static int runTasks(int count, const char* paths[], int priorities[], long quantum, bool stats) {
+    Scheduler scheduler;
+    initScheduler(&scheduler, quantum);
+
+    int status = 0;
+    for (int i = 0; i < count; i++) {
+        Source* source = openSource(paths[i]);
+        if (spawnTask(&scheduler, paths[i], source, priorities[i]) == NULL) status = 65;
+        releaseSource(source); // The task keeps its own reference
+    }
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if (status == 0) {
+        runScheduler(&scheduler);
+        for (Task* task = scheduler.done; task != NULL; task = task->next) {
+            if (task->result != INTERPRET_OK) status = 70;
+        }
+        if (stats) reportTasks(&scheduler);
+    }
+
+    freeScheduler(&scheduler);
+    return status;
+}
+
+// Debug switches can also come from the environment, so tracing doesn't need a different command line
+static bool envFlag(const char* name) {
+    const char* value = getenv(name);
+    return value != NULL && value[0] != '\0' && strcmp(value, "0") != 0;
 }
 
 int main(int argc, const char *argv[]) {
     initVM();
+    vm.traceExecution = envFlag("CLOX_TRACE");
+    vm.printCode = envFlag("CLOX_PRINT_CODE");
+
+    // Pull the flags out first, whatever is left over is the path
+    const char* path = NULL;
+    const char** paths = (const char**)malloc(sizeof(const char*) * argc);
+    int* priorities = (int*)malloc(sizeof(int) * argc);
+    int priority = 1;
+    long quantum = 1000;
+    const char* samplePath = NULL;
+    const char* heapProfilePath = NULL;
+    bool heapProfile = false;
+    size_t heapSampleBytes = 4096;
+    const char* emitPath = NULL;
+    bool stats = false;
+    bool phases = false;
+    bool serving = false;
+    bool pipelined = false;
+    bool watch = false;
+    int workers = 0;
+    const char* socketPath = NULL;
+    int pathCount = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--trace") == 0) {
+            vm.traceExecution = true;
+        } else if (strcmp(argv[i], "--print-code") == 0) {
+            vm.printCode = true;
+        } else if (strcmp(argv[i], "--registers") == 0) {
+            vm.registerMachine = true;
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            vm.jitEnabled = true;
+        } else if (strncmp(argv[i], "--jit-threshold=", 16) == 0) {
+            vm.jitEnabled = true;
+            vm.jitThreshold = atoi(argv[i] + 16);
+        } else if (strncmp(argv[i], "--profile", 9) == 0 && (argv[i][9] == '\0' || argv[i][9] == '=')) {
+            vm.profileExecution = true;
+            startProfile(argv[i][9] == '=' ? argv[i] + 10 : "clox-profile.json");
+        } else if (strncmp(argv[i], "--sample", 8) == 0 && (argv[i][8] == '\0' || argv[i][8] == '=')) {
+            samplePath = argv[i][8] == '=' ? argv[i] + 9 : "clox.folded";
+        } else if (strncmp(argv[i], "--heap-profile", 14) == 0 && (argv[i][14] == '\0' || argv[i][14] == '=')) {
+            heapProfile = true;
+            heapProfilePath = argv[i][14] == '=' ? argv[i] + 15 : NULL; // Default is stderr
+        } else if (strncmp(argv[i], "--heap-sample=", 14) == 0) {
+            heapSampleBytes = (size_t)atoll(argv[i] + 14);
+        } else if (strncmp(argv[i], "--max-instructions=", 19) == 0) {
+            vm.limits.instructions = atol(argv[i] + 19);
+        } else if (strncmp(argv[i], "--max-heap=", 11) == 0) {
+            vm.limits.heapBytes = (size_t)atoll(argv[i] + 11);
+        } else if (strncmp(argv[i], "--timeout=", 10) == 0) {
+            vm.limits.seconds = atof(argv[i] + 10);
+        } else if (strncmp(argv[i], "--priority=", 11) == 0) {
+            priority = atoi(argv[i] + 11);
+        } else if (strncmp(argv[i], "--quantum=", 10) == 0) {
+            quantum = atol(argv[i] + 10);
+            if (quantum < 1) quantum = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = true;
+        } else if (strcmp(argv[i], "--phases") == 0) {
+            phases = true;
+        } else if (strncmp(argv[i], "--serve", 7) == 0 && (argv[i][7] == '\0' || argv[i][7] == '=')) {
+            serving = true;
+            socketPath = argv[i][7] == '=' ? argv[i] + 8 : NULL; // Default is stdin/stdout
+        } else if (strncmp(argv[i], "--prefork=", 10) == 0) {
+            workers = atoi(argv[i] + 10);
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            pipelined = true;
+        } else if (strncmp(argv[i], "--memo", 6) == 0 && (argv[i][6] == '\0' || argv[i][6] == '=')) {
+            startMemo(argv[i][6] == '=' ? atoi(argv[i] + 7) : MEMO_ENTRIES);
+        } else if (strcmp(argv[i], "--watch") == 0) {
+            watch = true;
+        } else if (strncmp(argv[i], "--emit-c", 8) == 0 && (argv[i][8] == '\0' || argv[i][8] == '=')) {
+            emitPath = argv[i][8] == '=' ? argv[i] + 9 : "-";
+        } else {
+            path = argv[i];
+            paths[pathCount] = path;
+            priorities[pathCount] = priority;
+            pathCount++;
+        }
+    }
 
-    if (argc == 1) {
+    if ((hasLimits() || pathCount > 1) && vm.registerMachine) {
+        fprintf(stderr, "Limits and tasks need the stack machine, ignoring --registers.\n");
+        vm.registerMachine = false;
+    }
+
+    if (phases) startPhaseTiming();
+    if (heapProfile) startHeapProfile(heapProfilePath, heapSampleBytes);
+
+    // Only runSampled() keeps vm.sampleIp up to date, so anything that picks another loop would pin every sample to line 1
+    if (samplePath != NULL && (vm.registerMachine || hasLimits() || pathCount > 1 || vm.traceExecution || vm.profileExecution)) {
+        fprintf(stderr, "Sampling needs the plain stack machine, ignoring --sample with --registers, --trace, --profile, limits or tasks.\n");
+        samplePath = NULL;
+    }
+    if (samplePath != NULL) {
+        vm.sampleExecution = startSampler(path != NULL ? path : "repl", samplePath, 1000);
+        if (!vm.sampleExecution) fprintf(stderr, "Sampling isn't supported on this platform.\n");
+    }
+
+    int status = 0;
+    if (workers > 0 && emitPath == NULL && (serving ? socketPath != NULL : pathCount > 0)) {
+        status = prefork(workers, pathCount, paths, serving ? socketPath : NULL);
+    } else if (workers > 0) {
+        fprintf(stderr, "--prefork needs scripts for the workers to run, or --serve=socket path for them to share.\n");
+        status = 64;
+    } else if (serving && pathCount == 0 && emitPath == NULL) {
+        status = serve(socketPath);
+        if (stats) reportLatency(stderr);
+    } else if (serving) {
+        fprintf(stderr, "--serve takes its programs from requests, not paths.\n");
+        status = 64;
+    } else if (pathCount == 0 && pipelined && canPipeline()) {
+        replPipelined(stdin);
+    } else if (pathCount == 0) {
+        if (pipelined) fprintf(stderr, "Debugging, profiling and limits need the plain REPL, ignoring --pipeline.\n");
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    } else if (watch && pathCount == 1 && emitPath == NULL) {
+        status = watchFile(path);
+    } else if (watch) {
+        fprintf(stderr, "--watch takes one script.\n");
+        status = 64;
+    } else if (pathCount == 1 && emitPath != NULL) {
+        status = emitFile(path, emitPath);
+    } else if (pathCount == 1) {
+        status = runFile(path);
+    } else if (emitPath == NULL) {
+        status = runTasks(pathCount, paths, priorities, quantum, stats);
+        stats = false; // Already reported per task
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
+        fprintf(stderr, "Usage: clox [--trace] [--print-code] [--registers] [--jit] [--jit-threshold=bytes] [--profile[=json path]] [--sample[=folded path]] [--heap-profile[=report path]] [--heap-sample=bytes] [--emit-c[=c path]] [--serve[=socket path]] [--prefork=n] [--pipeline] [--watch] [--memo[=entries]] [--max-instructions=n] [--max-heap=bytes] [--timeout=seconds] [--stats] [--phases] [--quantum=n] [[--priority=n] path...]\n");
     }
 
+    if (stats) printUsage();
+    if (phases) printPhases();
+    free(paths);
+    free(priorities);
+
     freeVM();
-    return 0;
+    return status;
 }
\ No newline at end of file
@@ -0,0 +1,287 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+#include "memo.h"
+#include "object.h"
+#include "vm.h"
+
+typedef struct {
+    char* key;     // The source, or the bytecode as canonicalBytes() writes it. Compared in full when the hashes match.
+    int length;
+    uint32_t hash;
+    Value value;   // Strings that aren't shared get copied into chars instead, since the heap they're on may be freed
+    char* chars;
+    int charCount;
+    int next;      // Next entry in the same bucket, or -1
+    int newer;     // LRU list, or -1 at either end
+    int older;
+} MemoEntry;
+
+typedef struct {
+    MemoEntry* entries;
+    int count;
+    int capacity;
+    int* buckets;   // First entry in each, or -1
+    int bucketMask;
+    int newest;
+    int oldest;
+} MemoTable;
+
+// Memo memory uses plain malloc, since it isn't part of the program being measured (or limited)
+static MemoTable sources;
+static MemoTable code;
+static MemoStats stats;
+static char* scratch; // canonicalBytes() goes here
+static int scratchCapacity;
+
+static void* allocateMemo(size_t size) {
+    void* memory = malloc(size);
+    if (memory == NULL) exit(1);
+    return memory;
+}
+
+static void initTable(MemoTable* table, int capacity) {
+    int buckets = 1;
+    while (buckets < capacity * 2) buckets *= 2;
+    table->entries = (MemoEntry*)allocateMemo(sizeof(MemoEntry) * capacity);
+    table->count = 0;
+    table->capacity = capacity;
+    table->buckets = (int*)allocateMemo(sizeof(int) * buckets);
+    for (int i = 0; i < buckets; i++) table->buckets[i] = -1;
+    table->bucketMask = buckets - 1;
+    table->newest = table->oldest = -1;
+}
+
+static void emptyTable(MemoTable* table) {
+    for (int i = 0; i < table->count; i++) {
+        free(table->entries[i].key);
+        free(table->entries[i].chars);
+    }
+    table->count = 0;
+    for (int i = 0; i <= table->bucketMask; i++) table->buckets[i] = -1;
+    table->newest = table->oldest = -1;
+}
+
+static void freeTable(MemoTable* table) {
+    emptyTable(table);
+    free(table->entries);
+    free(table->buckets);
+    memset(table, 0, sizeof(MemoTable));
+}
+
+void startMemo(int capacity) {
+    if (vm.memoize) stopMemo();
+    if (capacity < 1) capacity = 1;
+    initTable(&sources, capacity);
+    initTable(&code, capacity);
+    memset(&stats, 0, sizeof(stats));
+    vm.memoize = true;
+}
+
+void clearMemo() {
+    if (!vm.memoize) return;
+    emptyTable(&sources);
+    emptyTable(&code);
+}
+
+void stopMemo() {
+    if (!vm.memoize) return;
+    freeTable(&sources);
+    freeTable(&code);
+    free(scratch);
+    scratch = NULL;
+    scratchCapacity = 0;
+    vm.memoize = false;
+}
+
+MemoStats memoStats() {
+    return stats;
+}
+
+static void unlinkRecent(MemoTable* table, int index) {
+    MemoEntry* entry = &table->entries[index];
+    if (entry->newer >= 0) table->entries[entry->newer].older = entry->older; else table->newest = entry->older;
+    if (entry->older >= 0) table->entries[entry->older].newer = entry->newer; else table->oldest = entry->newer;
+}
+
+static void linkNewest(MemoTable* table, int index) {
+    MemoEntry* entry = &table->entries[index];
+    entry->newer = -1;
+    entry->older = table->newest;
+    if (table->newest >= 0) table->entries[table->newest].newer = index; else table->oldest = index;
+    table->newest = index;
+}
+
+static int findEntry(MemoTable* table, const char* key, int length, uint32_t hash) {
+    for (int index = table->buckets[hash & table->bucketMask]; index >= 0; index = table->entries[index].next) {
+        MemoEntry* entry = &table->entries[index];
+        if (entry->hash == hash && entry->length == length && memcmp(entry->key, key, length) == 0) {
+            if (table->newest != index) {
+                unlinkRecent(table, index);
+                linkNewest(table, index);
+            }
+            return index;
+        }
+    }
+    return -1;
+}
+
+// Takes the oldest entry out of its bucket and frees what it held, so it can be reused
+static int evictOldest(MemoTable* table) {
+    int index = table->oldest;
+    MemoEntry* entry = &table->entries[index];
+    int* link = &table->buckets[entry->hash & table->bucketMask];
+    while (*link != index) link = &table->entries[*link].next;
+    *link = entry->next;
+    unlinkRecent(table, index);
+    free(entry->key);
+    free(entry->chars);
+    stats.evictions++;
+    return index;
+}
+
+static void insertEntry(MemoTable* table, const char* key, int length, uint32_t hash, Value value) {
+    if (findEntry(table, key, length, hash) >= 0) return; // Same key, so the same result
+    int index = table->count < table->capacity ? table->count++ : evictOldest(table);
+    MemoEntry* entry = &table->entries[index];
+    entry->key = (char*)allocateMemo(length);
+    memcpy(entry->key, key, length);
+    entry->length = length;
+    entry->hash = hash;
+    entry->value = value;
+    entry->chars = NULL;
+    entry->charCount = 0;
+    if (IS_STRING(value) && !AS_OBJ(value)->shared) {
+        ObjString* string = AS_STRING(value);
+        entry->chars = (char*)allocateMemo(string->length + 1); // Never 0 bytes, so NULL still means there aren't any
+        memcpy(entry->chars, string->chars, string->length);
+        entry->charCount = string->length;
+        entry->value = NIL_VAL;
+    }
+
+    int* bucket = &table->buckets[hash & table->bucketMask];
+    entry->next = *bucket;
+    *bucket = index;
+    linkNewest(table, index);
+    stats.stores++;
+}
+
+static Value entryValue(MemoEntry* entry) {
+    if (entry->chars == NULL) return entry->value;
+    return OBJ_VAL(copyString(entry->chars, entry->charCount));
+}
+
+static int instructionLength(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_INPUT:
+        case OP_RETURN_R:
+            return 2;
+        case OP_LOAD_R:
+        case OP_NOT_R:
+        case OP_NEGATE_R:
+            return 3;
+        case OP_EQUAL_R:
+        case OP_GREATER_R:
+        case OP_LESS_R:
+        case OP_ADD_R:
+        case OP_SUBTRACT_R:
+        case OP_MULTIPLY_R:
+        case OP_DIVIDE_R:
+            return 4;
+        default:
+            return 1;
+    }
+}
+
+// Whether running the chunk only computes a value from its constants. New opcodes that read or change anything else
+// (globals, input, the clock) belong in here, so chunks using them stop being remembered.
+static bool isPure(Chunk* chunk) {
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk->code[offset])) {
+        switch (chunk->code[offset]) {
+            case OP_INPUT:
+                return false;
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+static void appendScratch(int* length, const void* bytes, int count) {
+    if (*length + count > scratchCapacity) {
+        while (*length + count > scratchCapacity) scratchCapacity = scratchCapacity < 256 ? 256 : scratchCapacity * 2;
+        scratch = (char*)realloc(scratch, scratchCapacity);
+        if (scratch == NULL) exit(1);
+    }
+    memcpy(scratch + *length, bytes, count);
+    *length += count;
+}
+
+/*
+  The chunk as bytes two chunks share only if they compute the same thing: the code, then each constant's type and
+  contents. Constants are written out by value, since the same literal is a different object in every chunk.
+  Returns the length, or -1 if it would be over MEMO_MAX_KEY.
+*/
+static int canonicalBytes(Chunk* chunk) {
+    int length = 0;
+    appendScratch(&length, &chunk->registerCount, sizeof(int)); // Register code has its own opcodes, but be sure
+    appendScratch(&length, chunk->code, chunk->count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (length > MEMO_MAX_KEY) return -1;
+        Value value = chunk->constants.values[i];
+        if (IS_NUMBER(value)) {
+            double number = AS_NUMBER(value);
+            appendScratch(&length, "n", 1);
+            appendScratch(&length, &number, sizeof(double));
+        } else if (IS_STRING(value)) {
+            ObjString* string = AS_STRING(value);
+            appendScratch(&length, "s", 1);
+            appendScratch(&length, &string->length, sizeof(int));
+            appendScratch(&length, string->chars, string->length);
+        } else if (IS_BOOL(value)) {
+            appendScratch(&length, AS_BOOL(value) ? "t" : "f", 1);
+        } else {
+            appendScratch(&length, "0", 1);
+        }
+    }
+    return length > MEMO_MAX_KEY ? -1 : length;
+}
+
+bool recallSource(const char* source, Value* result) {
+    stats.lookups++;
+    size_t length = strlen(source);
+    if (length > MEMO_MAX_KEY) return false;
+    int index = findEntry(&sources, source, (int)length, hashString(source, (int)length));
+    if (index < 0) return false;
+    *result = entryValue(&sources.entries[index]);
+    stats.sourceHits++;
+    return true;
+}
+
+bool recallCode(const char* source, Chunk* chunk, Value* result) {
+    if (chunk->count > MEMO_MAX_KEY) return false;
+    int length = canonicalBytes(chunk);
+    if (length < 0) return false;
+    int index = findEntry(&code, scratch, length, hashString(scratch, length));
+    if (index < 0) return false;
+    *result = entryValue(&code.entries[index]);
+    stats.codeHits++;
+
+    size_t sourceLength = strlen(source);
+    if (sourceLength <= MEMO_MAX_KEY) insertEntry(&sources, source, (int)sourceLength, hashString(source, (int)sourceLength), *result);
+    return true;
+}
+
+void rememberResult(const char* source, Chunk* chunk, Value result) {
+    if (!isPure(chunk)) {
+        stats.impure++;
+        return;
+    }
+    size_t sourceLength = strlen(source);
+    if (sourceLength <= MEMO_MAX_KEY) insertEntry(&sources, source, (int)sourceLength, hashString(source, (int)sourceLength), result);
+    if (chunk->count > MEMO_MAX_KEY) return;
+    int length = canonicalBytes(chunk);
+    if (length >= 0) insertEntry(&code, scratch, length, hashString(scratch, length), result);
+}
@@ -0,0 +1,36 @@
+#ifndef clox_memo_h
+#define clox_memo_h
+
+#include "chunk.h"
+#include "common.h"
+#include "value.h"
+
+/*
+  Remembers what programs evaluated to, so a caller sending the same expression again gets its result without
+  compiling or running anything. Results are looked up by source first, then by bytecode, which catches sources
+  that only differ in spacing or comments. Both tables are LRU, capacity entries each.
+  Only chunks whose every instruction is pure get remembered (see isPure() in memo.c). Anything that reads state
+  from outside the program, like OP_INPUT does, makes its chunk run every time.
+*/
+
+#define MEMO_ENTRIES 1024 // Default capacity
+#define MEMO_MAX_KEY 4096 // Sources and bytecode longer than this aren't worth keeping a copy of
+
+typedef struct {
+    long lookups;    // Calls that asked
+    long sourceHits;
+    long codeHits;   // Source missed, but it compiled to code we've seen
+    long stores;
+    long evictions;
+    long impure;     // Chunks we ran but couldn't remember
+} MemoStats;
+
+void startMemo(int capacity); // Turns on vm.memoize
+void clearMemo();             // Forgets every result, for when something they depend on changes
+void stopMemo();
+bool recallSource(const char* source, Value* result);
+bool recallCode(const char* source, Chunk* chunk, Value* result); // Remembers source too, on a hit
+void rememberResult(const char* source, Chunk* chunk, Value result);
+MemoStats memoStats();
+
+#endif
@@ -1,9 +1,57 @@
+#include <stdio.h>
 #include <stdlib.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "heapprofile.h"
 #include "memory.h"
 #include "vm.h"
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+#ifndef _WIN32
+static pthread_mutex_t heapLock; // Recursive, since allocating an object takes it and then reallocates under it
+
+// Only the pipelined REPL has a second thread allocating, so everyone else skips the lock
+void shareHeap(bool shared) {
+    static bool initialized = false;
+    if (shared && !initialized) {
+        pthread_mutexattr_t attributes;
+        pthread_mutexattr_init(&attributes);
+        pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&heapLock, &attributes);
+        pthread_mutexattr_destroy(&attributes);
+        initialized = true;
+    }
+    vm.sharedHeap = shared;
+}
+
+void lockHeap() {
+    if (vm.sharedHeap) pthread_mutex_lock(&heapLock);
+}
+
+void unlockHeap() {
+    if (vm.sharedHeap) pthread_mutex_unlock(&heapLock);
+}
+#else
+void shareHeap(bool shared) { vm.sharedHeap = shared; }
+void lockHeap() {}
+void unlockHeap() {}
+#endif
+
+// reallocate() without the heap profiler hook, so objects don't get sampled twice
+static void* resize(void* pointer, size_t oldSize, size_t newSize) {
+    lockHeap();
+    vm.bytesAllocated += newSize - oldSize; // Wraps around correctly when shrinking
+    if (vm.bytesAllocated > vm.peakBytes) vm.peakBytes = vm.bytesAllocated;
+    unlockHeap();
+
     if (newSize == 0) {
         free(pointer);
         return NULL;
@@ -14,21 +62,226 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
-static void freeObject(Obj* object) {
+void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+    if (vm.profileHeap && newSize > oldSize) sampleAllocation(newSize - oldSize, ALLOCATION_BUFFER);
+    return resize(pointer, oldSize, newSize);
+}
+
+#ifdef OBJECT_COMPRESSION
+
+/*
+  The object region for compressed references. All of it is reserved up front so it never moves, and committed a
+  megabyte at a time as the bump pointer reaches it. Freed blocks up to 1KB go on a free list for their size (in 8 byte
+  steps), linked through their first 4 bytes. Bigger ones are only reclaimed when freeObjects() empties the region.
+*/
+#define REGION_SIZE      ((size_t)1 << 32) // Everything a 32-bit offset can reach
+#define REGION_COMMIT    ((size_t)1 << 20)
+#define REGION_ALIGNMENT 8
+#define REGION_CLASSES   128
+#define IMMORTAL_SIZE    ((size_t)1 << 28) // The top of the region, for allocateImmortal(). emptyRegion() never reaches it.
+
+uint8_t* objectRegion = NULL;
+static size_t regionUsed = REGION_ALIGNMENT; // Offset 0 stays unused, so no object's reference is 0
+static size_t regionCommitted = 0;
+static size_t immortalUsed = REGION_SIZE - IMMORTAL_SIZE;
+static size_t immortalCommitted = REGION_SIZE - IMMORTAL_SIZE;
+static ObjRef freeBlocks[REGION_CLASSES + 1]; // By size / REGION_ALIGNMENT, 0 when empty
+
+static void regionFailed(const char* what) {
+    fprintf(stderr, "Could not %s the object region.\n", what);
+    exit(1);
+}
+
+#ifdef _WIN32
+static void reserveRegion() {
+    objectRegion = (uint8_t*)VirtualAlloc(NULL, REGION_SIZE, MEM_RESERVE, PAGE_NOACCESS);
+    if (objectRegion == NULL) regionFailed("reserve");
+}
+
+static void commitRegion(size_t start, size_t end) {
+    if (VirtualAlloc(objectRegion + start, end - start, MEM_COMMIT, PAGE_READWRITE) == NULL) regionFailed("grow");
+}
+#else
+static void reserveRegion() {
+    void* region = mmap(NULL, REGION_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED) regionFailed("reserve");
+    objectRegion = (uint8_t*)region;
+}
+
+static void commitRegion(size_t start, size_t end) {
+    if (mprotect(objectRegion + start, end - start, PROT_READ | PROT_WRITE) != 0) regionFailed("grow");
+}
+#endif
+
+static void* allocateInRegion(size_t size) {
+    size = (size + REGION_ALIGNMENT - 1) & ~(size_t)(REGION_ALIGNMENT - 1);
+    size_t class = size / REGION_ALIGNMENT;
+    if (class <= REGION_CLASSES && freeBlocks[class] != 0) {
+        uint8_t* block = objectRegion + freeBlocks[class];
+        freeBlocks[class] = *(ObjRef*)block;
+        return block;
+    }
+
+    if (objectRegion == NULL) reserveRegion();
+    if (size > REGION_SIZE - IMMORTAL_SIZE - regionUsed) {
+        fprintf(stderr, "Object region is full.\n");
+        exit(1);
+    }
+    if (regionUsed + size > regionCommitted) {
+        size_t end = (regionUsed + size + REGION_COMMIT - 1) & ~(REGION_COMMIT - 1);
+        commitRegion(regionCommitted, end);
+        regionCommitted = end;
+    }
+
+    void* block = objectRegion + regionUsed;
+    regionUsed += size;
+    return block;
+}
+
+static void freeInRegion(void* pointer, size_t size) {
+    size = (size + REGION_ALIGNMENT - 1) & ~(size_t)(REGION_ALIGNMENT - 1);
+    size_t class = size / REGION_ALIGNMENT;
+    if (class > REGION_CLASSES) return; // Left where it is until the region is emptied
+    *(ObjRef*)pointer = freeBlocks[class];
+    freeBlocks[class] = (ObjRef)((uint8_t*)pointer - objectRegion);
+}
+
+static void* allocateImmortalInRegion(size_t size) {
+    size = (size + REGION_ALIGNMENT - 1) & ~(size_t)(REGION_ALIGNMENT - 1);
+    if (objectRegion == NULL) reserveRegion();
+    if (size > REGION_SIZE - immortalUsed) {
+        fprintf(stderr, "Object region is out of room for shared strings.\n");
+        exit(1);
+    }
+    if (immortalUsed + size > immortalCommitted) {
+        size_t end = (immortalUsed + size + REGION_COMMIT - 1) & ~(REGION_COMMIT - 1);
+        commitRegion(immortalCommitted, end);
+        immortalCommitted = end;
+    }
+
+    void* block = objectRegion + immortalUsed;
+    immortalUsed += size;
+    return block;
+}
+
+// Every object is gone, so start from the bottom again. What's committed stays committed.
+static void emptyRegion() {
+    regionUsed = REGION_ALIGNMENT;
+    for (int i = 0; i <= REGION_CLASSES; i++) freeBlocks[i] = 0;
+}
+
+#endif
+
+// Objects get their memory here instead of straight from reallocate(), because compressed references need them in the region
+void* allocateObjectMemory(size_t size, ObjType type) {
+    if (vm.profileHeap) sampleAllocation(size, type);
+#ifdef OBJECT_COMPRESSION
+    lockHeap();
+    vm.bytesAllocated += size;
+    if (vm.bytesAllocated > vm.peakBytes) vm.peakBytes = vm.bytesAllocated;
+    void* memory = allocateInRegion(size);
+    unlockHeap();
+    return memory;
+#else
+    return resize(NULL, 0, size);
+#endif
+}
+
+void freeObjectMemory(void* pointer, size_t size) {
+#ifdef OBJECT_COMPRESSION
+    lockHeap();
+    vm.bytesAllocated -= size;
+    freeInRegion(pointer, size);
+    unlockHeap();
+#else
+    resize(pointer, size, 0);
+#endif
+}
+
+#ifndef _WIN32
+static pthread_mutex_t immortalLock = PTHREAD_MUTEX_INITIALIZER; // Shards of the intern table allocate at the same time
+#endif
+
+#ifndef OBJECT_COMPRESSION
+/*
+  Without compressed references, immortal objects get blocks of their own, bump allocated, instead of sitting between
+  malloc()'s chunks. Nothing else writes to those pages, so once they're filled they stay shared with a forked parent
+  (see prefork.c), and what's filled stays together in the cache.
+*/
+#define IMMORTAL_BLOCK ((size_t)1 << 20)
+
+static uint8_t* immortalNext = NULL;
+static size_t immortalLeft = 0;
+
+static void* allocateImmortalBlock(size_t size) {
+#ifdef _WIN32
+    void* block = VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    void* block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED) block = NULL;
+#endif
+    if (block == NULL) {
+        fprintf(stderr, "Could not allocate memory for shared strings.\n");
+        exit(1);
+    }
+    return block;
+}
+
+static void* allocateImmortalInBlock(size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (size > IMMORTAL_BLOCK / 4) return allocateImmortalBlock(size); // Would waste too much of a block
+    if (size > immortalLeft) {
+        immortalNext = (uint8_t*)allocateImmortalBlock(IMMORTAL_BLOCK); // What's left of the old one stays unused
+        immortalLeft = IMMORTAL_BLOCK;
+    }
+    void* memory = immortalNext;
+    immortalNext += size;
+    immortalLeft -= size;
+    return memory;
+}
+#endif
+
+// For objects every VM shares (see intern.c). They're never freed, so they aren't counted in any VM's bytesAllocated either.
+void* allocateImmortal(size_t size) {
+#ifndef _WIN32
+    pthread_mutex_lock(&immortalLock);
+#endif
+#ifdef OBJECT_COMPRESSION
+    lockHeap(); // Reserving the region is shared with allocateInRegion()
+    void* memory = allocateImmortalInRegion(size);
+    unlockHeap();
+#else
+    void* memory = allocateImmortalInBlock(size);
+#endif
+#ifndef _WIN32
+    pthread_mutex_unlock(&immortalLock);
+#endif
+    return memory;
+}
+
+void freeObject(Obj* object) {
     switch(object->type) {
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
-            reallocate(string, sizeof(ObjString) + string->length * sizeof(char), 0);
+            size_t charsSize = IS_BORROWED(string) ? 0 : (string->length + 1) * sizeof(char); // Borrowed chars belong to someone else
+            freeObjectMemory(string, sizeof(ObjString) + charsSize);
             break;
         }
     }
 }
 
 void freeObjects() {
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+    ObjectTable* table = &vm.objects;
+    for (int i = 0; i < table->count; i++) {
+        freeObject(OBJECT_AT(table, i));
+    }
+
+    for (int i = 0; i < table->segmentCount; i++) {
+        FREE_ARRAY(ObjRef, table->segments[i], OBJECT_SEGMENT_SIZE);
     }
+    FREE_ARRAY(ObjRef*, table->segments, table->segmentCapacity);
+    initObjectTable(table);
+#ifdef OBJECT_COMPRESSION
+    emptyRegion();
+#endif
 }
\ No newline at end of file
@@ -20,6 +20,13 @@
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* allocateObjectMemory(size_t size, ObjType type);
+void freeObjectMemory(void* pointer, size_t size);
+void* allocateImmortal(size_t size); // Zeroed, and never freed
+void freeObject(Obj* object);
 void freeObjects();
+void shareHeap(bool shared); // While shared, allocating takes a lock, so a second thread can compile while the VM runs
+void lockHeap();
+void unlockHeap();
 
 #endif
\ No newline at end of file
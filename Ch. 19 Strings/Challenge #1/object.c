@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "intern.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
@@ -9,13 +10,40 @@
 #define ALLOCATE_OBJ(size, type, objectType) \
     (type*)allocateObject(sizeof(type), objectType)
 
+void initObjectTable(ObjectTable* table) {
+    table->segments = NULL;
+    table->segmentCount = 0;
+    table->segmentCapacity = 0;
+    table->count = 0;
+}
+
+static void addObject(ObjectTable* table, Obj* object) {
+    if (table->count == table->segmentCount * OBJECT_SEGMENT_SIZE) { // Every segment is full
+        if (table->segmentCount == table->segmentCapacity) {
+            int oldCapacity = table->segmentCapacity;
+            table->segmentCapacity = GROW_CAPACITY(oldCapacity);
+            table->segments = GROW_ARRAY(ObjRef*, table->segments, oldCapacity, table->segmentCapacity);
+        }
+        table->segments[table->segmentCount++] = ALLOCATE(ObjRef, OBJECT_SEGMENT_SIZE);
+    }
+    OBJECT_REF_AT(table, table->count) = OBJ_TO_REF(object);
+    table->count++;
+}
+
+// Takes the object at index out of the table (without freeing it) by moving the last one into its place
+void removeObject(ObjectTable* table, int index) {
+    table->count--;
+    OBJECT_REF_AT(table, index) = OBJECT_REF_AT(table, table->count);
+}
+
 // Allocates an object on the heap, then initializes type. The size is passed so the caller can add bytes for extra fields needed by specific objects.
 static Obj* allocateObject(size_t size, ObjType type) {
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
+    lockHeap(); // vm.objects is shared too
+    Obj* object = (Obj*)allocateObjectMemory(size, type);
     object->type = type;
-
-    object->next = vm.objects;
-    vm.objects = object;
+    object->shared = false;
+    addObject(&vm.objects, object);
+    unlockHeap();
     return object;
 }
 
@@ -23,30 +51,44 @@ static Obj* allocateObject(size_t size, ObjType type) {
 static ObjString* allocateString(char* chars, int length) {
     ObjString* string = (ObjString*)allocateObject(sizeof(ObjString) + ((length + 1) * sizeof(char)), OBJ_STRING);
     string->length = length;
-    memcpy(string->chars, chars, length);
-    string->chars[length] = '\0'; // WHY??????? WHY DO I NEED THIS NULL TERMINATOR???????????
+    string->chars = string->inlineChars;
+    memcpy(string->inlineChars, chars, length);
+    string->inlineChars[length] = '\0'; // WHY??????? WHY DO I NEED THIS NULL TERMINATOR???????????
     return string;
 }
 
-// Creates a ObjString from a string already allocated onto the heap.
+// Creates a ObjString from a string already allocated onto the heap. If it's one that's shared already, that's used instead.
 ObjString* takeString(char* chars, int length) {
-    ObjString* string = allocateString(chars, length);
-    FREE(char, chars);
+    ObjString* string = findInterned(chars, length);
+    if (string == NULL) string = allocateString(chars, length);
+    FREE_ARRAY(char, chars, length + 1);
     return string;
 }
 
 // Now a wrapper, mainly so I don't have to replace every call of copyString. Same reason I'm leaving the parameter.
+// Everything that calls it is making a literal, so the string gets shared if it can be, and vm.internLiterals allows it.
 ObjString* copyString(const char* chars, int length) {
+    ObjString* shared = vm.internLiterals ? internString(chars, length) : NULL;
+    if (shared != NULL) return shared;
+
     char* heapChars = ALLOCATE(char, length + 1);
     memcpy(heapChars, chars, length);
     heapChars[length] = '\0';
     return takeString(heapChars, length);
 }
 
+// Creates an ObjString that points at chars instead of copying them. Only for chars that outlive the string, like a Source that a chunk is holding onto.
+ObjString* borrowString(const char* chars, int length) {
+    ObjString* string = (ObjString*)allocateObject(sizeof(ObjString), OBJ_STRING);
+    string->length = length;
+    string->chars = chars;
+    return string;
+}
+
 void printObject(Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            writeOutput(&vm.out, AS_CSTRING(value), AS_STRING(value)->length);
             break;
     }
 }
\ No newline at end of file
@@ -9,26 +9,50 @@
 #define IS_STRING(value)    isObjType(value, OBJ_STRING) /* Used to check if Objs are strings, for safe casting. */
 
 #define AS_STRING(value)    ((ObjString*)AS_OBJ(value))
-#define AS_CSTRING(value)   (((ObjString*)AS_OBJ(value))->chars)
+#define AS_CSTRING(value)   (((ObjString*)AS_OBJ(value))->chars) /* Not null terminated for borrowed strings, so use length too! */
 
 typedef enum {
     OBJ_STRING,
 } ObjType;
 
 struct Obj {
-    ObjType type;
-    struct Obj* next;
-}; // No typedef because it was forward declared in value.h
+    uint8_t type; // An ObjType. A byte is plenty, and leaves room for the flag without making every object bigger.
+    bool shared;  // Interned in the process-wide table (see intern.h). Immortal, and not on any VM's vm.objects.
+}; // No typedef because it was forward declared in value.h. The VM finds objects through vm.objects, so there's no next pointer.
 
 struct ObjString { // Stored on heap
     // Having Obj as the first value allows ObjStrings to be safely casted to an Obj, and vice-versa. This also means that they share behavior and state, almost like inheritance in OOP.
     Obj obj; 
     int length;
-    char chars[]; 
+    const char* chars;    // Points at inlineChars, or for borrowed strings, straight into the source code. Only inlineChars is null terminated!
+    char inlineChars[]; 
 }; // No typedef because it was forward declared in value.h
 
+#define IS_BORROWED(string) ((string)->chars != (string)->inlineChars)
+
+#define OBJECT_SEGMENT_SIZE 512 // Objects per segment, so each one is 4KB of pointers (2KB of compressed references)
+
+/*
+  Every object the VM owns, in fixed-size segments of pointers. Walking it is a linear scan instead of chasing a pointer
+  through every object on the heap, and growing it never moves what's already there. Order isn't kept: removing an
+  object moves the last one into its slot.
+*/
+typedef struct {
+    ObjRef** segments;   // Only the last one in use can be partly full
+    int segmentCount;
+    int segmentCapacity;
+    int count;
+} ObjectTable;
+
+#define OBJECT_REF_AT(table, index) ((table)->segments[(index) / OBJECT_SEGMENT_SIZE][(index) % OBJECT_SEGMENT_SIZE])
+#define OBJECT_AT(table, index)     REF_TO_OBJ(OBJECT_REF_AT(table, index))
+
+void initObjectTable(ObjectTable* table);
+void removeObject(ObjectTable* table, int index);
+
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
+ObjString* borrowString(const char* chars, int length);
 void printObject(Value value);
 
 // Not put into macro body because "value" is referred to twice.
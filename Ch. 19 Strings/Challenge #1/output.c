@@ -0,0 +1,50 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "output.h"
+
+void initOutput(OutputBuffer* output, FILE* file) {
+    output->file = file;
+    output->count = 0;
+}
+
+void flushOutput(OutputBuffer* output) {
+    if (output->count > 0) {
+        fwrite(output->bytes, sizeof(char), output->count, output->file);
+        output->count = 0;
+    }
+    fflush(output->file);
+}
+
+void writeOutput(OutputBuffer* output, const char* chars, int length) {
+    if (output->count + length > OUTPUT_BUFFER_SIZE) {
+        flushOutput(output);
+
+        // Too big to ever fit, so skip the buffer entirely
+        if (length > OUTPUT_BUFFER_SIZE) {
+            fwrite(chars, sizeof(char), length, output->file);
+            return;
+        }
+    }
+
+    memcpy(output->bytes + output->count, chars, length);
+    output->count += length;
+}
+
+void writeString(OutputBuffer* output, const char* string) {
+    writeOutput(output, string, (int)strlen(string));
+}
+
+// Only used for the debug printing, so it's fine that this goes through vsnprintf
+void writeFormat(OutputBuffer* output, const char* format, ...) {
+    char chars[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(chars, sizeof(chars), format, args);
+    va_end(args);
+
+    if (length < 0) return;
+    if (length >= (int)sizeof(chars)) length = sizeof(chars) - 1; // Truncated
+    writeOutput(output, chars, length);
+}
@@ -0,0 +1,22 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+#define OUTPUT_BUFFER_SIZE 8192
+
+typedef struct {
+    FILE* file; // Where the bytes go when the buffer gets flushed
+    int count;  // Number of bytes waiting in the buffer
+    char bytes[OUTPUT_BUFFER_SIZE];
+} OutputBuffer; // Collects output so we hit stdio (and the OS) once per flush instead of once per value
+
+void initOutput(OutputBuffer* output, FILE* file);
+void writeOutput(OutputBuffer* output, const char* chars, int length);
+void writeString(OutputBuffer* output, const char* string);
+void writeFormat(OutputBuffer* output, const char* format, ...);
+void flushOutput(OutputBuffer* output);
+
+#endif
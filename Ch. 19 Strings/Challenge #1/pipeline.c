@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#include "compiler.h"
+#include "memory.h"
+#include "pipeline.h"
+#include "source.h"
+#include "vm.h"
+
+bool canPipeline() {
+#ifdef _WIN32
+    return false;
+#else
+    return !vm.traceExecution && !vm.printCode && !vm.profileExecution && !vm.sampleExecution && !vm.profileHeap &&
+           !vm.timePhases && !hasLimits();
+#endif
+}
+
+#ifndef _WIN32
+
+typedef struct {
+    Chunk chunk;       // Ready to run
+    bool compiled;
+    bool end;          // Input ran out. The VM finishes the last prompt and stops.
+    char* errors;      // Compile errors, held back until the VM gets here so they come out where the plain REPL puts them
+    size_t errorLength;
+} Compiled;
+
+typedef struct {
+    Compiled items[PIPELINE_DEPTH];
+    int head;  // Next one the VM takes
+    int count;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    bool vmWaiting;    // Only signal whoever is actually asleep. Most puts and takes then don't need a wakeup.
+    bool frontWaiting;
+    FILE* input;
+} Pipeline;
+
+static Pipeline pipeline;
+
+static void put(Compiled* item) {
+    pthread_mutex_lock(&pipeline.lock);
+    while (pipeline.count == PIPELINE_DEPTH) {
+        pipeline.frontWaiting = true;
+        pthread_cond_wait(&pipeline.notFull, &pipeline.lock);
+    }
+    pipeline.frontWaiting = false;
+    pipeline.items[(pipeline.head + pipeline.count) % PIPELINE_DEPTH] = *item;
+    pipeline.count++;
+    if (pipeline.vmWaiting) pthread_cond_signal(&pipeline.notEmpty);
+    pthread_mutex_unlock(&pipeline.lock);
+}
+
+static Compiled take() {
+    pthread_mutex_lock(&pipeline.lock);
+    while (pipeline.count == 0) {
+        pipeline.vmWaiting = true;
+        pthread_cond_wait(&pipeline.notEmpty, &pipeline.lock);
+    }
+    pipeline.vmWaiting = false;
+    Compiled item = pipeline.items[pipeline.head];
+    pipeline.head = (pipeline.head + 1) % PIPELINE_DEPTH;
+    pipeline.count--;
+    if (pipeline.frontWaiting) pthread_cond_signal(&pipeline.notFull);
+    pthread_mutex_unlock(&pipeline.lock);
+    return item;
+}
+
+// Reads, scans and compiles every line of input, then queues an end marker
+static void* frontEnd(void* unused) {
+    (void)unused;
+    Line line;
+    initLine(&line);
+
+    // One stream catches every line's errors. It's emptied after each line, and errors are rare, so most lines copy nothing.
+    char* caught = NULL;
+    size_t caughtLength = 0;
+    FILE* errors = open_memstream(&caught, &caughtLength);
+    if (errors == NULL) {
+        fprintf(stderr, "Could not capture compile errors.\n");
+        exit(74);
+    }
+    compileOffThread(errors);
+
+    for (;;) {
+        Compiled item;
+        memset(&item, 0, sizeof(item));
+        if (!readLine(pipeline.input, &line)) {
+            item.end = true;
+            put(&item);
+            break;
+        }
+
+        initChunk(&item.chunk);
+        item.compiled = compile(line.chars, &item.chunk);
+        fflush(errors); // Brings caughtLength up to date
+        if (caughtLength > 0) {
+            item.errors = (char*)malloc(caughtLength);
+            if (item.errors == NULL) exit(1);
+            memcpy(item.errors, caught, caughtLength);
+            item.errorLength = caughtLength;
+            fseek(errors, 0, SEEK_SET); // Empties it again
+        }
+
+        // Chunks aren't frozen here. A REPL line is small, and mapping, protecting and unmapping a block for each one costs
+        // more than it saves once there are two threads, since every munmap() has to shoot down the other one's TLB.
+        if (!item.compiled) freeChunk(&item.chunk);
+        put(&item);
+    }
+
+    compileOffThread(NULL);
+    fclose(errors);
+    free(caught);
+    freeLine(&line);
+    return NULL;
+}
+
+void replPipelined(FILE* input) {
+    pipeline.head = 0;
+    pipeline.count = 0;
+    pipeline.vmWaiting = false;
+    pipeline.frontWaiting = false;
+    pipeline.input = input;
+    pthread_mutex_init(&pipeline.lock, NULL);
+    pthread_cond_init(&pipeline.notEmpty, NULL);
+    pthread_cond_init(&pipeline.notFull, NULL);
+
+    shareHeap(true);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, frontEnd, NULL) != 0) {
+        fprintf(stderr, "Could not start the compiler thread.\n");
+        exit(71);
+    }
+
+    // Same output as the plain REPL, except the prompt isn't flushed on its own. Nobody's waiting to type at it.
+    for (;;) {
+        Compiled item = take();
+        writeOutput(&vm.out, "> ", 2);
+        if (item.end) {
+            writeOutput(&vm.out, "\n", 1);
+            break;
+        }
+
+        if (item.compiled) {
+            runChunk(&item.chunk);
+        } else {
+            flushOutput(&vm.out); // What errorAt() would have done
+            fwrite(item.errors, 1, item.errorLength, vm.err);
+        }
+        freeChunk(&item.chunk);
+        free(item.errors);
+    }
+
+    pthread_join(thread, NULL);
+    shareHeap(false);
+    pthread_cond_destroy(&pipeline.notFull);
+    pthread_cond_destroy(&pipeline.notEmpty);
+    pthread_mutex_destroy(&pipeline.lock);
+}
+
+#else
+
+void replPipelined(FILE* input) {
+    (void)input;
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef clox_pipeline_h
+#define clox_pipeline_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+/*
+  The REPL with compiling split off onto its own thread. The front end reads and compiles lines up to PIPELINE_DEPTH
+  ahead, while the VM runs the ones before them, so a stream of input spends its time running instead of waiting on
+  the compiler. What gets printed, and the order it's printed in, is the same as the plain REPL's.
+*/
+
+#define PIPELINE_DEPTH 64 // Compiled lines waiting on the VM. The front end blocks when this many are queued.
+
+bool canPipeline(); // Not with the debugging, profiling or metering switches, which all expect compiling to be on the VM's thread
+void replPipelined(FILE* input);
+
+#endif
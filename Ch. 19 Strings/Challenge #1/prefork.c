@@ -0,0 +1,249 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "compiler.h"
+#include "memory.h"
+#include "prefork.h"
+#include "server.h"
+#include "vm.h"
+
+#ifndef _WIN32
+
+#define MAX_WORKERS 256
+
+// All in kB, the unit smaps uses
+typedef struct {
+    long rss;
+    long shared;      // Shared_Clean + Shared_Dirty: pages still shared with the parent (or other processes)
+    long private;     // Private_Clean + Private_Dirty
+    long privateDirty;
+    long chunks;      // Rss of the frozen chunks' mappings
+    long chunksDirty; // Private_Dirty of those. Anything here got copied after the fork.
+} Footprint;
+
+typedef struct {
+    pid_t pid;
+    int report; // Read end of the pipe the worker writes its Footprint to
+    int status;
+    Footprint footprint;
+    bool reported;
+} Worker;
+
+static Chunk* chunks;
+static int chunkCount;
+static volatile sig_atomic_t stopping = 0;
+
+static void handleStop(int signal) {
+    (void)signal;
+    stopping = 1;
+}
+
+static bool inChunk(unsigned long start, unsigned long end) {
+    for (int i = 0; i < chunkCount; i++) {
+        unsigned long frozen = (unsigned long)chunks[i].frozen;
+        if (chunks[i].frozen != NULL && frozen < end && frozen + chunks[i].frozenSize > start) return true;
+    }
+    return false;
+}
+
+// Adds up /proc/self/smaps, which is one header line per mapping followed by its fields
+static Footprint measure() {
+    Footprint footprint = {0, 0, 0, 0, 0, 0};
+    FILE* file = fopen("/proc/self/smaps", "r");
+    if (file == NULL) return footprint;
+
+    char line[512];
+    bool chunk = false;
+    while (fgets(line, sizeof(line), file)) {
+        unsigned long start, end;
+        long kB;
+        char field[64];
+        if (sscanf(line, "%lx-%lx", &start, &end) == 2) {
+            chunk = inChunk(start, end);
+        } else if (sscanf(line, "%63[^:]: %ld kB", field, &kB) == 2) {
+            if (strcmp(field, "Rss") == 0) {
+                footprint.rss += kB;
+                if (chunk) footprint.chunks += kB;
+            } else if (strcmp(field, "Shared_Clean") == 0 || strcmp(field, "Shared_Dirty") == 0) {
+                footprint.shared += kB;
+            } else if (strcmp(field, "Private_Clean") == 0) {
+                footprint.private += kB;
+            } else if (strcmp(field, "Private_Dirty") == 0) {
+                footprint.private += kB;
+                footprint.privateDirty += kB;
+                if (chunk) footprint.chunksDirty += kB;
+            }
+        }
+    }
+    fclose(file);
+    return footprint;
+}
+
+// Like runFile()'s exit codes
+static int exitCode(InterpretResult result) {
+    if (result == INTERPRET_OK) return 0;
+    if (result == INTERPRET_COMPILE_ERROR) return 65;
+    return 70;
+}
+
+static int runWorker(int listener, int report) {
+    int status = 0;
+    for (int i = 0; i < chunkCount; i++) {
+        int code = exitCode(runChunk(&chunks[i]));
+        if (code > status) status = code;
+    }
+    flushOutput(&vm.out); // Before serving swaps vm.out's file for each request's
+    if (listener >= 0) serveListener(listener);
+
+    Footprint footprint = measure();
+    if (write(report, &footprint, sizeof(footprint)) != (ssize_t)sizeof(footprint)) status = status == 0 ? 74 : status;
+    close(report);
+    return status;
+}
+
+// Compiles each script and freezes it, so the workers get read-only chunks. Returns false if one didn't compile.
+static bool load(int count, const char* paths[]) {
+    chunks = ALLOCATE(Chunk, count);
+    chunkCount = 0;
+    for (int i = 0; i < count; i++) {
+        Source* source = openSource(paths[i]);
+        Chunk* chunk = &chunks[chunkCount++];
+        initChunk(chunk);
+        retainSource(source);
+        chunk->source = source; // String literals borrow from it, then freezing copies them in with the code
+        bool compiled = compile(source->chars, chunk);
+        releaseSource(source);
+        if (!compiled) return false;
+        freezeChunk(chunk); // Still runs unfrozen, it just won't be as well shared
+    }
+    return true;
+}
+
+static void unload() {
+    for (int i = 0; i < chunkCount; i++) freeChunk(&chunks[i]);
+    FREE_ARRAY(Chunk, chunks, chunkCount);
+    chunks = NULL;
+    chunkCount = 0;
+}
+
+static void printFootprint(const char* name, long pid, Footprint* footprint, bool forked) {
+    fprintf(stderr, "%-8s %8ld %10ld %10ld %10ld %12ld %10ld", name, pid, footprint->rss, footprint->shared,
+            footprint->private, footprint->privateDirty, footprint->chunks);
+    if (forked) {
+        fprintf(stderr, " %10ld\n", footprint->chunksDirty);
+    } else {
+        fprintf(stderr, " %10s\n", "-"); // The parent wrote them, and was measured before forking anyway
+    }
+}
+
+// Workers stop on SIGTERM once they're serving, so pass the parent's on to them
+static void catchStop() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleStop; // No SA_RESTART, so waitpid() returns and we notice
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
+
+int prefork(int workerCount, int count, const char* paths[], const char* socketPath) {
+    if (workerCount > MAX_WORKERS) workerCount = MAX_WORKERS;
+    if (!load(count, paths)) {
+        unload();
+        return 65;
+    }
+
+    int listener = -1;
+    if (socketPath != NULL) {
+        listener = openListener(socketPath);
+        if (listener < 0) {
+            unload();
+            return 74;
+        }
+    }
+
+    Footprint parent = measure();
+    flushOutput(&vm.out); // Or every worker would print it again
+    fflush(stdout);
+    fflush(stderr);
+    catchStop();
+
+    Worker workers[MAX_WORKERS];
+    int started = 0;
+    for (; started < workerCount; started++) {
+        int fds[2];
+        if (pipe(fds) != 0) break;
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(fds[0]);
+            close(fds[1]);
+            break;
+        }
+        if (pid == 0) {
+            close(fds[0]);
+            _exit(runWorker(listener, fds[1])); // Not exit(), the parent's the one to write reports and clean up
+        }
+        close(fds[1]);
+        workers[started] = (Worker){pid, fds[0], 0, {0, 0, 0, 0, 0, 0}, false};
+    }
+    if (started < workerCount) fprintf(stderr, "Could only start %d of %d workers: %s.\n", started, workerCount, strerror(errno));
+
+    int status = 0;
+    bool forwarded = false;
+    for (int i = 0; i < started; i++) {
+        int waitStatus;
+        while (waitpid(workers[i].pid, &waitStatus, 0) < 0) {
+            if (errno != EINTR) break;
+            if (stopping && !forwarded) {
+                for (int j = 0; j < started; j++) kill(workers[j].pid, SIGTERM);
+                forwarded = true;
+            }
+        }
+        workers[i].status = WIFEXITED(waitStatus) ? WEXITSTATUS(waitStatus) : 70;
+        workers[i].reported = read(workers[i].report, &workers[i].footprint, sizeof(Footprint)) == (ssize_t)sizeof(Footprint);
+        close(workers[i].report);
+        if (workers[i].status > status) status = workers[i].status;
+    }
+
+    if (listener >= 0) {
+        close(listener);
+        unlink(socketPath);
+    }
+
+    fprintf(stderr, "%-8s %8s %10s %10s %10s %12s %10s %10s\n",
+            "process", "pid", "rss kB", "shared kB", "private kB", "dirty kB", "chunk kB", "copied kB");
+    printFootprint("parent", (long)getpid(), &parent, false);
+    for (int i = 0; i < started; i++) {
+        char name[24];
+        snprintf(name, sizeof(name), "worker %d", i);
+        if (workers[i].reported) {
+            printFootprint(name, (long)workers[i].pid, &workers[i].footprint, true);
+        } else {
+            fprintf(stderr, "%-8s %8ld exited with %d before reporting\n", name, (long)workers[i].pid, workers[i].status);
+        }
+    }
+
+    unload();
+    return status;
+}
+
+#else
+
+int prefork(int workers, int count, const char* paths[], const char* socketPath) {
+    (void)workers;
+    (void)count;
+    (void)paths;
+    (void)socketPath;
+    fprintf(stderr, "Forking workers isn't supported on this platform.\n");
+    return 64;
+}
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef clox_prefork_h
+#define clox_prefork_h
+
+#include "common.h"
+
+/*
+  Compiles and freezes the given scripts once, then forks workers that all run them, and serve requests on socketPath
+  when it isn't NULL. Everything the workers only read stays shared with the parent: frozen chunks are read-only
+  mappings, shared strings live in blocks nothing else writes to (see allocateImmortal()), and objects have no header
+  that gets written after they're made. Each worker reports its memory from /proc/self/smaps when it's done, and the
+  parent prints them all. Returns the exit code, the worst of the workers'.
+*/
+int prefork(int workers, int count, const char* paths[], const char* socketPath);
+
+#endif
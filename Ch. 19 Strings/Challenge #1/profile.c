@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <time.h>
+#endif
+
+#include "debug.h"
+#include "profile.h"
+
+#define OPCODE_SLOTS 256 // Opcodes are bytes, so this covers any opcode we'll ever add
+#define TOP_ENTRIES 20   // How many pairs and lines the text report shows
+
+typedef enum {
+    CLASS_LOAD,       // OP_CONSTANT, OP_NIL, OP_TRUE, OP_FALSE, OP_INPUT (and the register machine versions of each of these)
+    CLASS_COMPARE,    // OP_EQUAL, OP_GREATER, OP_LESS
+    CLASS_ARITHMETIC, // OP_ADD, OP_SUBTRACT, OP_MULTIPLY, OP_DIVIDE, OP_NEGATE
+    CLASS_LOGIC,      // OP_NOT
+    CLASS_CONTROL,    // OP_RETURN, and anything we don't know about
+    CLASS_COUNT
+} OpcodeClass; // Opcodes grouped by what kind of work they do, for the cycle counts
+
+static const char* classNames[CLASS_COUNT] = {"load", "compare", "arithmetic", "logic", "control"};
+
+typedef struct {
+    const char* jsonPath;
+    uint64_t opcodes[OPCODE_SLOTS];
+    uint64_t* pairs;         // OPCODE_SLOTS * OPCODE_SLOTS counts, indexed by first * OPCODE_SLOTS + second
+    uint64_t* lines;         // Instructions executed per source line, indexed by line number
+    int lineCapacity;
+    uint64_t classCounts[CLASS_COUNT];
+    uint64_t classTicks[CLASS_COUNT];
+    int previous;            // Opcode of the instruction before this one, or -1 at the start of a chunk
+    uint64_t previousStart;  // Tick count when that instruction started
+} Profile;
+
+static Profile profile;
+
+// Cycle counter where the CPU has a cheap one, nanoseconds where it doesn't
+static uint64_t readTicks() {
+#if defined(__x86_64__) || defined(__i386__) || defined(_MSC_VER)
+    return __rdtsc();
+#else
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+#endif
+}
+
+static OpcodeClass classOf(int opcode) {
+    switch (opcode) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_INPUT:
+        case OP_LOAD_R:
+            return CLASS_LOAD;
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_EQUAL_R:
+        case OP_GREATER_R:
+        case OP_LESS_R:
+            return CLASS_COMPARE;
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NEGATE:
+        case OP_ADD_R:
+        case OP_SUBTRACT_R:
+        case OP_MULTIPLY_R:
+        case OP_DIVIDE_R:
+        case OP_NEGATE_R:
+            return CLASS_ARITHMETIC;
+        case OP_NOT:
+        case OP_NOT_R:
+            return CLASS_LOGIC;
+        default:
+            return CLASS_CONTROL;
+    }
+}
+
+// Profiling memory uses plain malloc, since it isn't part of the program being measured
+static void* allocateCounts(size_t count) {
+    void* counts = calloc(count, sizeof(uint64_t));
+    if (counts == NULL) exit(1);
+    return counts;
+}
+
+void startProfile(const char* jsonPath) {
+    memset(&profile, 0, sizeof(profile));
+    profile.jsonPath = jsonPath;
+    profile.pairs = (uint64_t*)allocateCounts(OPCODE_SLOTS * OPCODE_SLOTS);
+    profile.previous = -1;
+}
+
+// Charges the time since the last instruction started to that instruction's class
+static void finishPrevious(uint64_t now) {
+    if (profile.previous < 0) return;
+    OpcodeClass opcodeClass = classOf(profile.previous);
+    profile.classCounts[opcodeClass]++;
+    profile.classTicks[opcodeClass] += now - profile.previousStart;
+}
+
+static void countLine(int line) {
+    if (line >= profile.lineCapacity) {
+        int oldCapacity = profile.lineCapacity;
+        int capacity = oldCapacity < 64 ? 64 : oldCapacity * 2;
+        while (capacity <= line) capacity *= 2;
+
+        profile.lines = (uint64_t*)realloc(profile.lines, capacity * sizeof(uint64_t));
+        if (profile.lines == NULL) exit(1);
+        memset(profile.lines + oldCapacity, 0, (capacity - oldCapacity) * sizeof(uint64_t));
+        profile.lineCapacity = capacity;
+    }
+    profile.lines[line]++;
+}
+
+// Called by runProfiled() right before it executes the instruction at ip
+void profileInstruction(Chunk* chunk, uint8_t* ip) {
+    uint64_t now = readTicks();
+    finishPrevious(now);
+
+    int opcode = *ip;
+    profile.opcodes[opcode]++;
+    if (profile.previous >= 0) profile.pairs[profile.previous * OPCODE_SLOTS + opcode]++;
+    countLine(chunk->lines[ip - chunk->code]);
+
+    profile.previous = opcode;
+    profile.previousStart = readTicks(); // Read again so the bookkeeping above isn't charged to the instruction
+}
+
+// The last instruction of a chunk has nothing after it to end its timing, so run() ending does it instead
+void endProfileRun() {
+    finishPrevious(readTicks());
+    profile.previous = -1; // Pairs don't span chunks
+}
+
+static const char* nameOf(int opcode, char* fallback) {
+    const char* name = opcodeName((uint8_t)opcode);
+    if (name != NULL) return name;
+    sprintf(fallback, "OP_%d", opcode);
+    return fallback;
+}
+
+typedef struct {
+    int index;
+    uint64_t count;
+} Entry; // One row of a report, so rows can be sorted by count
+
+static int compareEntries(const void* a, const void* b) {
+    uint64_t countA = ((const Entry*)a)->count;
+    uint64_t countB = ((const Entry*)b)->count;
+    if (countA != countB) return countA < countB ? 1 : -1; // Most executed first
+    return ((const Entry*)a)->index - ((const Entry*)b)->index;
+}
+
+// Copies the nonzero counts into entries, sorted, and returns how many there are
+static int sortCounts(const uint64_t* counts, int size, Entry* entries) {
+    int count = 0;
+    for (int i = 0; i < size; i++) {
+        if (counts[i] == 0) continue;
+        entries[count].index = i;
+        entries[count].count = counts[i];
+        count++;
+    }
+    qsort(entries, count, sizeof(Entry), compareEntries);
+    return count;
+}
+
+static void writeReport(FILE* file, Entry* opcodes, int opcodeCount, Entry* pairs, int pairCount, Entry* lines, int lineCount) {
+    char first[16];
+    char second[16];
+    uint64_t total = 0;
+    for (int i = 0; i < opcodeCount; i++) total += opcodes[i].count;
+
+    fprintf(file, "== opcode profile (%llu instructions) ==\n", (unsigned long long)total);
+    for (int i = 0; i < opcodeCount; i++) {
+        fprintf(file, "%-16s %12llu %6.2f%%\n", nameOf(opcodes[i].index, first),
+                (unsigned long long)opcodes[i].count, 100.0 * opcodes[i].count / total);
+    }
+
+    fprintf(file, "== top opcode pairs ==\n");
+    for (int i = 0; i < pairCount && i < TOP_ENTRIES; i++) {
+        fprintf(file, "%-16s -> %-16s %12llu\n", nameOf(pairs[i].index / OPCODE_SLOTS, first),
+                nameOf(pairs[i].index % OPCODE_SLOTS, second), (unsigned long long)pairs[i].count);
+    }
+
+    fprintf(file, "== top lines ==\n");
+    for (int i = 0; i < lineCount && i < TOP_ENTRIES; i++) {
+        fprintf(file, "line %-11d %12llu\n", lines[i].index, (unsigned long long)lines[i].count);
+    }
+
+    fprintf(file, "== ticks per opcode class ==\n");
+    for (int i = 0; i < CLASS_COUNT; i++) {
+        if (profile.classCounts[i] == 0) continue;
+        fprintf(file, "%-16s %12llu ticks %8.1f per instruction\n", classNames[i],
+                (unsigned long long)profile.classTicks[i], (double)profile.classTicks[i] / profile.classCounts[i]);
+    }
+}
+
+static void writeJson(FILE* file, Entry* opcodes, int opcodeCount, Entry* pairs, int pairCount, Entry* lines, int lineCount) {
+    char first[16];
+    char second[16];
+
+    fprintf(file, "{\n  \"opcodes\": [");
+    for (int i = 0; i < opcodeCount; i++) {
+        fprintf(file, "%s\n    {\"name\": \"%s\", \"count\": %llu}", i == 0 ? "" : ",",
+                nameOf(opcodes[i].index, first), (unsigned long long)opcodes[i].count);
+    }
+
+    fprintf(file, "\n  ],\n  \"pairs\": [");
+    for (int i = 0; i < pairCount; i++) {
+        fprintf(file, "%s\n    {\"first\": \"%s\", \"second\": \"%s\", \"count\": %llu}", i == 0 ? "" : ",",
+                nameOf(pairs[i].index / OPCODE_SLOTS, first), nameOf(pairs[i].index % OPCODE_SLOTS, second),
+                (unsigned long long)pairs[i].count);
+    }
+
+    fprintf(file, "\n  ],\n  \"lines\": [");
+    for (int i = 0; i < lineCount; i++) {
+        fprintf(file, "%s\n    {\"line\": %d, \"count\": %llu}", i == 0 ? "" : ",",
+                lines[i].index, (unsigned long long)lines[i].count);
+    }
+
+    fprintf(file, "\n  ],\n  \"classes\": [");
+    bool firstClass = true;
+    for (int i = 0; i < CLASS_COUNT; i++) {
+        if (profile.classCounts[i] == 0) continue;
+        fprintf(file, "%s\n    {\"class\": \"%s\", \"count\": %llu, \"ticks\": %llu}", firstClass ? "" : ",",
+                classNames[i], (unsigned long long)profile.classCounts[i], (unsigned long long)profile.classTicks[i]);
+        firstClass = false;
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+
+// Writes the sorted report to stderr and the JSON to the path given to startProfile(), then frees everything
+void dumpProfile() {
+    Entry* opcodes = (Entry*)malloc(OPCODE_SLOTS * sizeof(Entry));
+    Entry* pairs = (Entry*)malloc(OPCODE_SLOTS * OPCODE_SLOTS * sizeof(Entry));
+    Entry* lines = (Entry*)malloc((profile.lineCapacity + 1) * sizeof(Entry));
+    if (opcodes == NULL || pairs == NULL || lines == NULL) exit(1);
+
+    int opcodeCount = sortCounts(profile.opcodes, OPCODE_SLOTS, opcodes);
+    int pairCount = sortCounts(profile.pairs, OPCODE_SLOTS * OPCODE_SLOTS, pairs);
+    int lineCount = sortCounts(profile.lines, profile.lineCapacity, lines);
+
+    writeReport(stderr, opcodes, opcodeCount, pairs, pairCount, lines, lineCount);
+
+    FILE* json = fopen(profile.jsonPath, "w");
+    if (json == NULL) {
+        fprintf(stderr, "Could not write profile to \"%s\".\n", profile.jsonPath);
+    } else {
+        writeJson(json, opcodes, opcodeCount, pairs, pairCount, lines, lineCount);
+        fclose(json);
+    }
+
+    free(opcodes);
+    free(pairs);
+    free(lines);
+    free(profile.pairs);
+    free(profile.lines);
+    memset(&profile, 0, sizeof(profile));
+}
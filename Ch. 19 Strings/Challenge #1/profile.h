@@ -0,0 +1,11 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include "chunk.h"
+
+void startProfile(const char* jsonPath);
+void profileInstruction(Chunk* chunk, uint8_t* ip);
+void endProfileRun();
+void dumpProfile();
+
+#endif
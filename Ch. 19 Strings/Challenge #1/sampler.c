@@ -0,0 +1,153 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/time.h>
+#endif
+
+#include "sampler.h"
+#include "vm.h"
+
+#define SAMPLE_MAX 65536 // Samples waiting to be resolved. Anything past this is dropped (and counted).
+
+typedef struct {
+    Phase phase;
+    int offset; // Offset of the instruction in vm.chunk when phase is PHASE_RUN, otherwise -1
+} Sample; // What the signal handler saw when the timer went off
+
+typedef struct {
+    const char* scriptName; // The root frame of every stack
+    const char* foldedPath;
+    Sample samples[SAMPLE_MAX];
+    volatile sig_atomic_t count;
+    volatile sig_atomic_t dropped;
+    long phaseCounts[PHASE_COUNT]; // Resolved samples for the phases that don't have lines
+    long* lineCounts;              // Resolved PHASE_RUN samples per source line
+    int lineCapacity;
+} Sampler;
+
+static Sampler sampler;
+static const char* phaseNames[PHASE_COUNT] = {"other", "scan", "compile", "run"};
+
+#ifndef _WIN32
+// Only touches memory that's already allocated, so it's safe to run in the middle of anything
+static void handleSample(int signal) {
+    (void)signal;
+    if (sampler.count >= SAMPLE_MAX) {
+        sampler.dropped++;
+        return;
+    }
+
+    Sample* sample = &sampler.samples[sampler.count];
+    sample->phase = vm.phase;
+    sample->offset = vm.phase == PHASE_RUN ? (int)(vm.sampleIp - vm.chunk->code) : -1;
+    sampler.count++;
+}
+#endif
+
+// Starts the interval timer. Returns false if this platform doesn't have SIGPROF.
+bool startSampler(const char* scriptName, const char* foldedPath, int hertz) {
+#ifdef _WIN32
+    (void)scriptName;
+    (void)foldedPath;
+    (void)hertz;
+    return false;
+#else
+    memset(&sampler, 0, sizeof(sampler));
+    sampler.scriptName = scriptName;
+    sampler.foldedPath = foldedPath;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleSample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0) return false;
+
+    // ITIMER_PROF counts CPU time, so a program waiting on input doesn't pile up samples
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / hertz;
+    timer.it_value = timer.it_interval;
+    return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+#endif
+}
+
+static void countLine(int line) {
+    if (line >= sampler.lineCapacity) {
+        int oldCapacity = sampler.lineCapacity;
+        int capacity = oldCapacity < 64 ? 64 : oldCapacity * 2;
+        while (capacity <= line) capacity *= 2;
+
+        sampler.lineCounts = (long*)realloc(sampler.lineCounts, capacity * sizeof(long));
+        if (sampler.lineCounts == NULL) exit(1);
+        memset(sampler.lineCounts + oldCapacity, 0, (capacity - oldCapacity) * sizeof(long));
+        sampler.lineCapacity = capacity;
+    }
+    sampler.lineCounts[line]++;
+}
+
+/*
+  Turns the raw samples into counts per phase and per line. Run samples only have an offset into the chunk,
+  so this has to happen while the chunk they came from is still around. Called right before interpret() frees it.
+*/
+void resolveSamples(Chunk* chunk) {
+#ifndef _WIN32
+    // Hold the timer off while we read the buffer, so the handler can't write to it underneath us
+    sigset_t block;
+    sigset_t previous;
+    sigemptyset(&block);
+    sigaddset(&block, SIGPROF);
+    sigprocmask(SIG_BLOCK, &block, &previous);
+
+    for (int i = 0; i < sampler.count; i++) {
+        Sample* sample = &sampler.samples[i];
+        if (sample->phase == PHASE_RUN && chunk != NULL && sample->offset >= 0 && sample->offset < chunk->count) {
+            countLine(chunk->lines[sample->offset]);
+        } else {
+            sampler.phaseCounts[sample->phase == PHASE_RUN ? PHASE_IDLE : sample->phase]++;
+        }
+    }
+    sampler.count = 0;
+
+    sigprocmask(SIG_SETMASK, &previous, NULL);
+#else
+    (void)chunk;
+#endif
+}
+
+// Stops the timer and writes the samples out as folded stacks ("root;phase;line count"), which flame graph tools read directly
+void stopSampler() {
+#ifndef _WIN32
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    resolveSamples(NULL); // Anything left over was taken outside of a chunk
+
+    FILE* file = fopen(sampler.foldedPath, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write samples to \"%s\".\n", sampler.foldedPath);
+    } else {
+        for (int i = 0; i < PHASE_COUNT; i++) {
+            if (sampler.phaseCounts[i] > 0) {
+                fprintf(file, "%s;%s %ld\n", sampler.scriptName, phaseNames[i], sampler.phaseCounts[i]);
+            }
+        }
+        for (int line = 0; line < sampler.lineCapacity; line++) {
+            if (sampler.lineCounts[line] > 0) {
+                fprintf(file, "%s;run;line %d %ld\n", sampler.scriptName, line, sampler.lineCounts[line]);
+            }
+        }
+        fclose(file);
+    }
+
+    if (sampler.dropped > 0) {
+        fprintf(stderr, "Sampler dropped %ld samples.\n", (long)sampler.dropped);
+    }
+    free(sampler.lineCounts);
+    sampler.lineCounts = NULL;
+    sampler.lineCapacity = 0;
+#endif
+}
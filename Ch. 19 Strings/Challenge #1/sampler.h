@@ -0,0 +1,10 @@
+#ifndef clox_sampler_h
+#define clox_sampler_h
+
+#include "chunk.h"
+
+bool startSampler(const char* scriptName, const char* foldedPath, int hertz);
+void resolveSamples(Chunk* chunk);
+void stopSampler();
+
+#endif
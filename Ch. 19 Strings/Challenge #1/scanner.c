@@ -18,6 +18,13 @@ void initScanner(const char* source) {
     scanner.line = 1;
 }
 
+// Picks up scanning from the middle of a source, for rescanning just what an edit touched (see incremental.c)
+void resumeScanner(const char* current, int line) {
+    scanner.start = current;
+    scanner.current = current;
+    scanner.line = line;
+}
+
 static bool isAlpha(char c) {
     return (c >= 'a' && c <= 'z') ||
            (c >= 'A' && c <= 'Z') ||
@@ -98,7 +105,7 @@ static void skipWhitespace() {
             case '/':
                 if (peekNext() == '/') { // If it isn't a double slash, we don't want to mark it as whitespace
                     // A comment goes until the end of the line.
-                    while (peek() != '\n' && !isAtEnd()) advance;
+                    while (peek() != '\n' && !isAtEnd()) advance();
                 } else {
                     return;
                 }
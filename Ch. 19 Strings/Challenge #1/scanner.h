@@ -45,6 +45,7 @@ typedef struct {
 } Token;
 
 void initScanner(const char* source);
+void resumeScanner(const char* current, int line);
 Token scanToken();
 
 #endif
\ No newline at end of file
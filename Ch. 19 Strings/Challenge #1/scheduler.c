@@ -0,0 +1,175 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "compiler.h"
+#include "heapprofile.h"
+#include "memory.h"
+#include "scheduler.h"
+
+/*
+  Green threads for the VM. Every task gets its own chunk and saved stack, but they all take turns on the one global vm:
+  a task is switched in by loading its ip and copying its stack back, runs resume() for its quantum, and is switched out
+  again if it isn't finished. Expressions only keep a few values on the stack, so a switch is a couple of small copies.
+  A task that needs no more than one quantum never waits longer than one turn of everything ahead of it.
+*/
+
+static double now() {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+void initScheduler(Scheduler* scheduler, long quantum) {
+    scheduler->head = NULL;
+    scheduler->tail = NULL;
+    scheduler->done = NULL;
+    scheduler->quantum = quantum;
+    scheduler->switches = 0;
+}
+
+static void enqueue(Scheduler* scheduler, Task* task) {
+    task->next = NULL;
+    if (scheduler->tail == NULL) {
+        scheduler->head = task;
+    } else {
+        scheduler->tail->next = task;
+    }
+    scheduler->tail = task;
+}
+
+static Task* dequeue(Scheduler* scheduler) {
+    Task* task = scheduler->head;
+    scheduler->head = task->next;
+    if (scheduler->head == NULL) scheduler->tail = NULL;
+    return task;
+}
+
+// Compiles source into a new ready task. Returns NULL (after the compiler has reported why) if it doesn't compile.
+Task* spawnTask(Scheduler* scheduler, const char* name, Source* source, int priority) {
+    Task* task = ALLOCATE(Task, 1);
+    task->name = name;
+    initChunk(&task->chunk);
+    retainSource(source);
+    task->chunk.source = source;
+
+    size_t heapBefore = vm.bytesAllocated;
+    vm.phase = PHASE_COMPILE;
+    bool compiled = compile(source->chars, &task->chunk);
+    vm.phase = PHASE_IDLE;
+    if (!compiled) {
+        freeChunk(&task->chunk);
+        FREE(Task, task);
+        return NULL;
+    }
+
+    task->ip = task->chunk.code;
+    task->stack = NULL;
+    task->stackCount = 0;
+    task->stackCapacity = 0;
+    task->priority = priority < 1 ? 1 : priority;
+    task->result = INTERPRET_OK;
+    task->instructions = 0;
+    task->heapBytes = vm.bytesAllocated - heapBefore; // Constants count, like they do for interpret()
+    task->slices = 0;
+    task->finishedAt = 0;
+    enqueue(scheduler, task);
+    return task;
+}
+
+static void switchIn(Task* task) {
+    vm.chunk = &task->chunk;
+    vm.ip = task->ip;
+    if (task->stackCount > 0) memcpy(vm.stack + 1, task->stack, sizeof(Value) * task->stackCount); // stack is NULL before the first switch out
+    vm.stackTop = vm.stack + 1 + task->stackCount;
+}
+
+static void switchOut(Task* task) {
+    task->ip = vm.ip;
+    int count = (int)(vm.stackTop - (vm.stack + 1));
+    if (count > task->stackCapacity) {
+        int oldCapacity = task->stackCapacity;
+        while (task->stackCapacity < count) task->stackCapacity = GROW_CAPACITY(task->stackCapacity);
+        task->stack = GROW_ARRAY(Value, task->stack, oldCapacity, task->stackCapacity);
+    }
+    if (count > 0) memcpy(task->stack, vm.stack + 1, sizeof(Value) * count);
+    task->stackCount = count;
+}
+
+// Gives the task in the VM its next slice, metered against vm.limits if there are any
+static InterpretResult runTurn(Scheduler* scheduler, Task* task, double start) {
+    bool limited = hasLimits();
+    if (limited) {
+        InterpretResult trap = checkTaskLimits(task->instructions, task->heapBytes, now() - start);
+        if (trap != INTERPRET_OK) return trap;
+    }
+
+    long budget = scheduler->quantum * task->priority;
+    if (vm.limits.instructions > 0 && vm.limits.instructions - task->instructions < budget) {
+        budget = vm.limits.instructions - task->instructions; // Then the next turn's check stops it
+    }
+    long granted = budget;
+    size_t heapBefore = vm.bytesAllocated;
+    vm.heapCeiling = vm.limits.heapBytes > 0 ? heapBefore + (vm.limits.heapBytes - task->heapBytes) : SIZE_MAX;
+
+    InterpretResult result = resume(&budget);
+    task->instructions += granted - budget;
+    if (limited && vm.bytesAllocated > heapBefore) task->heapBytes += vm.bytesAllocated - heapBefore;
+    return result;
+}
+
+// Runs every ready task to completion (or until it goes over vm.limits), a quantum at a time
+void runScheduler(Scheduler* scheduler) {
+    double start = now();
+    vm.phase = PHASE_RUN;
+    while (scheduler->head != NULL) {
+        Task* task = dequeue(scheduler);
+        switchIn(task);
+        InterpretResult result = runTurn(scheduler, task, start);
+        task->slices++;
+        scheduler->switches++;
+
+        if (result == INTERPRET_YIELD) {
+            switchOut(task);
+            enqueue(scheduler, task);
+        } else {
+            task->result = result;
+            task->finishedAt = now() - start;
+            FREE_ARRAY(Value, task->stack, task->stackCapacity); // Nothing left to resume
+            task->stack = NULL;
+            task->stackCapacity = 0;
+            task->next = scheduler->done;
+            scheduler->done = task;
+        }
+        if (vm.profileHeap) checkHeapProfileSignal();
+    }
+    vm.heapCeiling = SIZE_MAX;
+    vm.phase = PHASE_IDLE;
+}
+
+// One line per finished task on stderr, for --stats
+void reportTasks(Scheduler* scheduler) {
+    flushOutput(&vm.out); // The tasks' output first
+    fprintf(stderr, "%-24s %8s %12s %8s %12s  %s\n", "task", "priority", "instructions", "slices", "finished ms", "result");
+    for (Task* task = scheduler->done; task != NULL; task = task->next) {
+        fprintf(stderr, "%-24s %8d %12ld %8d %12.3f  %s\n", task->name, task->priority, task->instructions, task->slices,
+                task->finishedAt * 1000, task->result == INTERPRET_OK ? "ok" : "error");
+    }
+    fprintf(stderr, "%ld switches\n", scheduler->switches);
+}
+
+void freeScheduler(Scheduler* scheduler) {
+    Task* lists[] = {scheduler->head, scheduler->done};
+    for (int i = 0; i < 2; i++) {
+        Task* task = lists[i];
+        while (task != NULL) {
+            Task* next = task->next;
+            freeChunk(&task->chunk);
+            FREE_ARRAY(Value, task->stack, task->stackCapacity);
+            FREE(Task, task);
+            task = next;
+        }
+    }
+    initScheduler(scheduler, scheduler->quantum);
+}
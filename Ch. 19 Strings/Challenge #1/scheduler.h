@@ -0,0 +1,37 @@
+#ifndef clox_scheduler_h
+#define clox_scheduler_h
+
+#include "chunk.h"
+#include "vm.h"
+
+typedef struct Task {
+    const char* name;
+    Chunk chunk;
+    uint8_t* ip;         // Where to pick up again
+    Value* stack;        // The live part of the stack, saved while another task has the VM
+    int stackCount;
+    int stackCapacity;
+    int priority;        // Quanta per turn, so higher gets more instructions each time around
+    InterpretResult result;
+    long instructions;   // Executed so far
+    size_t heapBytes;    // How much it has grown the heap by, compiling included
+    int slices;          // Turns taken
+    double finishedAt;   // Seconds after runScheduler() started
+    struct Task* next;
+} Task; // A compiled program that runs a slice at a time, interleaved with the others
+
+typedef struct {
+    Task* head;  // Ready queue, run round robin
+    Task* tail;
+    Task* done;  // Finished tasks, most recent first
+    long quantum; // Instructions per priority point per turn
+    long switches;
+} Scheduler;
+
+void initScheduler(Scheduler* scheduler, long quantum);
+Task* spawnTask(Scheduler* scheduler, const char* name, Source* source, int priority);
+void runScheduler(Scheduler* scheduler);
+void reportTasks(Scheduler* scheduler);
+void freeScheduler(Scheduler* scheduler);
+
+#endif
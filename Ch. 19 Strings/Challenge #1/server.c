@@ -0,0 +1,295 @@
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "memory.h"
+#include "server.h"
+#include "vm.h"
+
+#define LATENCY_BUCKETS 32 // Bucket 0 is under a microsecond, bucket n is [2^(n-1), 2^n) microseconds
+
+typedef struct {
+    long buckets[LATENCY_BUCKETS];
+    long count;
+    double total; // Seconds
+    double max;
+} Latency; // From having a whole request to having written the whole response
+
+static Latency latency;
+
+static double now() {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static void recordLatency(double seconds) {
+    double microseconds = seconds * 1e6;
+    int bucket = 0;
+    while (bucket < LATENCY_BUCKETS - 1 && microseconds >= (double)(1L << bucket)) bucket++;
+    latency.buckets[bucket]++;
+    latency.count++;
+    latency.total += seconds;
+    if (seconds > latency.max) latency.max = seconds;
+}
+
+// Upper edge of the bucket the given fraction of requests falls in, in microseconds
+static long percentile(double fraction) {
+    long wanted = (long)(latency.count * fraction + 0.5);
+    long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += latency.buckets[i];
+        if (seen >= wanted && seen > 0) return 1L << i;
+    }
+    return 1L << (LATENCY_BUCKETS - 1);
+}
+
+void reportLatency(FILE* file) {
+    if (latency.count == 0) {
+        fprintf(file, "requests: 0\n");
+        return;
+    }
+    fprintf(file, "requests: %ld, mean %.1f us, max %.1f us, p50 < %ld us, p90 < %ld us, p99 < %ld us\n",
+            latency.count, latency.total / latency.count * 1e6, latency.max * 1e6,
+            percentile(0.5), percentile(0.9), percentile(0.99));
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        if (latency.buckets[i] == 0) continue;
+        fprintf(file, "%10ld - %-10ld us %10ld\n", i == 0 ? 0 : 1L << (i - 1), 1L << i, latency.buckets[i]);
+    }
+}
+
+#ifndef _WIN32
+
+static volatile sig_atomic_t stopping = 0;
+
+static void handleStop(int signal) {
+    (void)signal;
+    stopping = 1;
+}
+
+// Both return false on EOF or errors. A signal telling us to stop counts as an error.
+static bool readFully(int fd, void* bytes, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t count = read(fd, (char*)bytes + done, length - done);
+        if (count < 0 && errno == EINTR && !stopping) continue;
+        if (count <= 0) return false;
+        done += (size_t)count;
+    }
+    return true;
+}
+
+static bool writeFully(int fd, const void* bytes, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t count = write(fd, (const char*)bytes + done, length - done);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        done += (size_t)count;
+    }
+    return true;
+}
+
+static bool readLength(int fd, uint32_t* length) {
+    uint8_t bytes[4];
+    if (!readFully(fd, bytes, 4)) return false;
+    *length = (uint32_t)bytes[0] << 24 | (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+    return true;
+}
+
+static bool writeLength(int fd, size_t length) {
+    uint8_t bytes[4] = {(uint8_t)(length >> 24), (uint8_t)(length >> 16), (uint8_t)(length >> 8), (uint8_t)length};
+    return writeFully(fd, bytes, 4);
+}
+
+static bool respond(int fd, InterpretResult result, const char* output, size_t outputLength, const char* errors, size_t errorLength) {
+    uint8_t status = (uint8_t)result;
+    return writeFully(fd, &status, 1) &&
+           writeLength(fd, outputLength) && writeFully(fd, output, outputLength) &&
+           writeLength(fd, errorLength) && writeFully(fd, errors, errorLength);
+}
+
+// Runs one request with vm.out and vm.err pointed at memory, then sends back what they caught
+static bool evaluate(int fd, const char* source) {
+    char* output = NULL;
+    size_t outputLength = 0;
+    char* errors = NULL;
+    size_t errorLength = 0;
+    FILE* outputFile = open_memstream(&output, &outputLength);
+    FILE* errorFile = open_memstream(&errors, &errorLength);
+    if (outputFile == NULL || errorFile == NULL) {
+        fprintf(stderr, "Could not capture output: %s.\n", strerror(errno));
+        exit(74);
+    }
+
+    FILE* stdoutFile = vm.out.file;
+    vm.out.file = outputFile;
+    vm.err = errorFile;
+    int before = vm.objects.count;
+
+    // Shared strings are immortal and don't count toward --max-heap, so a request's literals stay on its own heap, freed below
+    vm.internLiterals = false;
+    InterpretResult result = interpret(source);
+    vm.internLiterals = true;
+    flushOutput(&vm.out);
+
+    // Nothing outlives a request, so give back whatever it allocated. The allocator keeps its pools warm for the next one.
+    while (vm.objects.count > before) {
+        freeObject(OBJECT_AT(&vm.objects, vm.objects.count - 1));
+        removeObject(&vm.objects, vm.objects.count - 1);
+    }
+
+    vm.out.file = stdoutFile;
+    vm.err = stderr;
+    fclose(outputFile); // Only now are output and outputLength final
+    fclose(errorFile);
+
+    bool sent = respond(fd, result, output, outputLength, errors, errorLength);
+    free(output);
+    free(errors);
+    return sent;
+}
+
+static bool sendLatency(int fd) {
+    char* report = NULL;
+    size_t reportLength = 0;
+    FILE* file = open_memstream(&report, &reportLength);
+    if (file == NULL) return respond(fd, INTERPRET_OK, "", 0, "", 0);
+    reportLatency(file);
+    fclose(file);
+
+    bool sent = respond(fd, INTERPRET_OK, report, reportLength, "", 0);
+    free(report);
+    return sent;
+}
+
+// Answers requests on one connection until it closes, breaks the protocol, or we're told to stop
+static void serveConnection(int in, int out) {
+    char* source = NULL;
+    uint32_t capacity = 0;
+
+    uint32_t length;
+    while (!stopping && readLength(in, &length)) {
+        if (length == 0) {
+            if (!sendLatency(out)) break;
+            continue;
+        }
+        if (length > SERVER_MAX_REQUEST) {
+            const char* message = "Request too large.\n";
+            respond(out, INTERPRET_COMPILE_ERROR, "", 0, message, strlen(message));
+            break; // Can't trust where the next frame starts
+        }
+
+        if (length + 1 > capacity) {
+            capacity = length + 1;
+            source = (char*)realloc(source, capacity);
+            if (source == NULL) {
+                fprintf(stderr, "Not enough memory for a %u byte request.\n", length);
+                exit(74);
+            }
+        }
+        if (!readFully(in, source, length)) break;
+        source[length] = '\0';
+
+        double start = now();
+        bool sent = evaluate(out, source);
+        recordLatency(now() - start);
+        if (!sent) break;
+    }
+
+    free(source);
+}
+
+static void catchSignals() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleStop; // No SA_RESTART, so a blocked accept() or read() returns and we notice
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN); // A client hanging up shows up as a failed write instead of killing us
+}
+
+int openListener(const char* socketPath) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path \"%s\" is too long.\n", socketPath);
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        fprintf(stderr, "Could not create socket: %s.\n", strerror(errno));
+        return -1;
+    }
+    unlink(socketPath); // Left over from a server that didn't get to clean up
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(listener, 16) < 0) {
+        fprintf(stderr, "Could not listen on \"%s\": %s.\n", socketPath, strerror(errno));
+        close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+void serveListener(int listener) {
+    catchSignals();
+    // One connection at a time, since there's one VM. Clients queue up in the backlog, or go to another worker (see prefork.c).
+    while (!stopping) {
+        int client = accept(listener, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Could not accept a connection: %s.\n", strerror(errno));
+            break;
+        }
+        serveConnection(client, client);
+        close(client);
+    }
+}
+
+int serve(const char* socketPath) {
+    if (socketPath == NULL) {
+        catchSignals();
+        serveConnection(STDIN_FILENO, STDOUT_FILENO);
+        return 0;
+    }
+
+    int listener = openListener(socketPath);
+    if (listener < 0) return 74;
+    serveListener(listener);
+    close(listener);
+    unlink(socketPath);
+    return 0;
+}
+
+#else
+
+int serve(const char* socketPath) {
+    (void)socketPath;
+    fprintf(stderr, "Serving isn't supported on this platform.\n");
+    return 64;
+}
+
+int openListener(const char* socketPath) {
+    (void)socketPath;
+    fprintf(stderr, "Serving isn't supported on this platform.\n");
+    return -1;
+}
+
+void serveListener(int listener) {
+    (void)listener;
+}
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef clox_server_h
+#define clox_server_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+/*
+  Evaluation server, so a stream of small programs can share one warm VM instead of paying for a process each.
+  Every integer in a frame is 4 bytes, big-endian.
+    Request:  length, then that many bytes of source. A length of 0 asks for the latency histogram instead.
+    Response: 1 byte InterpretResult, then length + whatever the program printed, then length + its error messages.
+*/
+
+#define SERVER_MAX_REQUEST (16 * 1024 * 1024) // Bigger requests get an error and the connection closed
+
+int serve(const char* socketPath); // Serves stdin/stdout when socketPath is NULL. Returns the exit code.
+int openListener(const char* socketPath); // A listening Unix socket, or -1 after saying why not
+void serveListener(int listener);         // Until SIGINT or SIGTERM. Leaves the listener open.
+void reportLatency(FILE* file);
+
+#endif
@@ -0,0 +1,169 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "memory.h"
+#include "source.h"
+
+// The old readFile() from main.c. Used when a file can't be mapped.
+static char* readFile(const char* path, size_t* length) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        exit(74);
+    }
+
+    fseek(file, 0L, SEEK_END);
+    size_t fileSize = ftell(file);
+    rewind(file);
+
+    char* buffer = (char*)malloc(fileSize + 1); // +1 for null terminator
+    if (buffer == NULL) {
+        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
+        exit(74);
+    }
+
+    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
+    if (bytesRead < fileSize) {
+        fprintf(stderr, "Could not read file \"%s\".\n", path);
+        exit(74);
+    }
+
+    buffer[bytesRead] = '\0';
+
+    fclose(file);
+    *length = bytesRead;
+    return buffer;
+}
+
+/*
+  Maps the file read-only and returns a pointer to it, or NULL if it couldn't (or shouldn't) be mapped.
+  The OS fills the rest of the last page with zeros, which gives us the null terminator for free.
+  That only works if the file doesn't end exactly on a page boundary, so those (and empty files) get read normally instead.
+*/
+#ifdef _WIN32
+static const char* mapFile(const char* path, size_t* length, void** mapping) {
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+
+    LARGE_INTEGER size;
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0 || size.QuadPart % info.dwPageSize == 0) {
+        CloseHandle(file);
+        return NULL;
+    }
+
+    HANDLE map = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file); // The mapping keeps its own reference to the file
+    if (map == NULL) return NULL;
+
+    const char* chars = (const char*)MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+    if (chars == NULL) {
+        CloseHandle(map);
+        return NULL;
+    }
+
+    *length = (size_t)size.QuadPart;
+    *mapping = map;
+    return chars;
+}
+#else
+static const char* mapFile(const char* path, size_t* length) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat info;
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (fstat(fd, &info) != 0 || info.st_size == 0 || info.st_size % pageSize == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void* chars = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping stays valid after the descriptor is closed
+    if (chars == MAP_FAILED) return NULL;
+
+    *length = (size_t)info.st_size;
+    return (const char*)chars;
+}
+#endif
+
+Source* openSource(const char* path) {
+    Source* source = ALLOCATE(Source, 1);
+    source->refCount = 1;
+
+#ifdef _WIN32
+    source->chars = mapFile(path, &source->length, &source->mapping);
+#else
+    source->chars = mapFile(path, &source->length);
+#endif
+    source->mapped = source->chars != NULL;
+
+    if (!source->mapped) {
+        source->chars = readFile(path, &source->length); // Also reports the error if the file can't be opened
+    }
+    return source;
+}
+
+void retainSource(Source* source) {
+    source->refCount++;
+}
+
+void releaseSource(Source* source) {
+    if (--source->refCount > 0) return;
+
+    if (!source->mapped) {
+        free((char*)source->chars);
+    } else {
+#ifdef _WIN32
+        UnmapViewOfFile(source->chars);
+        CloseHandle(source->mapping);
+#else
+        munmap((void*)source->chars, source->length);
+#endif
+    }
+    FREE(Source, source);
+}
+
+void initLine(Line* line) {
+    line->chars = NULL;
+    line->length = 0;
+    line->capacity = 0;
+}
+
+// Reads with fgets() a piece at a time, doubling the buffer until the newline turns up. The buffer comes from plain
+// realloc(), since it belongs to the REPL rather than to any program.
+bool readLine(FILE* file, Line* line) {
+    line->length = 0;
+    for (;;) {
+        if (line->capacity - line->length < 2) {
+            line->capacity = line->capacity < 1024 ? 1024 : line->capacity * 2;
+            line->chars = (char*)realloc(line->chars, line->capacity);
+            if (line->chars == NULL) {
+                fprintf(stderr, "Not enough memory to read a line.\n");
+                exit(74);
+            }
+        }
+
+        size_t room = line->capacity - line->length;
+        if (!fgets(line->chars + line->length, room > INT_MAX ? INT_MAX : (int)room, file)) return line->length > 0;
+        line->length += strlen(line->chars + line->length);
+        if (line->length > 0 && line->chars[line->length - 1] == '\n') return true;
+    }
+}
+
+void freeLine(Line* line) {
+    free(line->chars);
+    initLine(line);
+}
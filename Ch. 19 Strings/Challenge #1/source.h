@@ -0,0 +1,32 @@
+#ifndef clox_source_h
+#define clox_source_h
+
+#include <stdio.h>
+
+#include "common.h"
+
+typedef struct {
+    const char* chars; // Always null terminated, because the scanner stops at '\0'
+    size_t length;
+    int refCount;      // The file stays open (or mapped) until this hits 0
+    bool mapped;       // true if chars points straight into a read-only mapping of the file
+#ifdef _WIN32
+    void* mapping;     // The file mapping HANDLE, needed to close it again
+#endif
+} Source; // A source file loaded for compiling. String literals can point right into it, so chunks hold a reference.
+
+Source* openSource(const char* path);
+void retainSource(Source* source);
+void releaseSource(Source* source);
+
+typedef struct {
+    char* chars;
+    size_t length;   // Including the newline, if the line had one
+    size_t capacity;
+} Line; // One line of REPL input, however long it is. Reused from line to line.
+
+void initLine(Line* line);
+bool readLine(FILE* file, Line* line); // false at EOF with nothing read
+void freeLine(Line* line);
+
+#endif
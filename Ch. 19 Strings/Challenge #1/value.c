@@ -1,9 +1,12 @@
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "object.h"
 #include "memory.h"
 #include "value.h"
+#include "vm.h"
 
 void initValueArray(ValueArray* array) {
     array->values = NULL;
@@ -27,29 +30,355 @@ void freeValueArray(ValueArray* array) {
     initValueArray(array);
 }
 
+// Writes the digits of an integer backwards into the end of buffer, then moves them to the front
+static int formatInteger(uint64_t integer, bool negative, char* buffer) {
+    char digits[NUMBER_BUFFER_SIZE];
+    int start = NUMBER_BUFFER_SIZE;
+    do {
+        digits[--start] = (char)('0' + integer % 10);
+        integer /= 10;
+    } while (integer != 0);
+    if (negative) digits[--start] = '-';
+
+    int length = NUMBER_BUFFER_SIZE - start;
+    memcpy(buffer, digits + start, length);
+    buffer[length] = '\0';
+    return length;
+}
+
+#ifdef __SIZEOF_INT128__
+
+/*
+  Shortest digits, the Ryu way (Ulf Adams, "Ryu: fast float-to-string conversion", PLDI 2018). The double's rounding interval
+  gets scaled by a power of ten with one 64x128 bit multiply per bound, then digits come off the bounds until they'd
+  disagree. What's left is the shortest decimal inside the interval, rounded correctly.
+  Ryu ships its powers of 5 as big tables of constants. These get worked out exactly with a little bignum instead, the
+  first time a number needs them.
+*/
+#define POW5_BITS 125           // Significant bits kept of each power of 5, and of each inverse
+#define POW5_TABLE_SIZE 326     // 5^i for doubles with negative binary exponents
+#define POW5_INV_TABLE_SIZE 342 // 2^k / 5^i for positive ones
+#define BIG_LIMBS 30            // 960 bits, room for 2^(bits of 5^341 + POW5_BITS)
+
+typedef struct {
+    uint32_t limbs[BIG_LIMBS]; // Least significant first
+} Big;
+
+static uint64_t pow5Split[POW5_TABLE_SIZE][2];       // Low word, high word
+static uint64_t pow5InvSplit[POW5_INV_TABLE_SIZE][2];
+static bool pow5Ready = false; // Only the VM's thread prints
+
+// Bits in 5^e, for e > 0. Exact up to e = 3528.
+static int pow5Bits(int e) {
+    return (int)(((uint32_t)e * 1217359) >> 19) + 1;
+}
+
+static int log10Pow2(int e) {
+    return (int)(((uint32_t)e * 78913) >> 18);
+}
+
+static int log10Pow5(int e) {
+    return (int)(((uint32_t)e * 732923) >> 20);
+}
+
+static void multiplyBig(Big* big, uint32_t factor) {
+    uint64_t carry = 0;
+    for (int i = 0; i < BIG_LIMBS; i++) {
+        uint64_t product = (uint64_t)big->limbs[i] * factor + carry;
+        big->limbs[i] = (uint32_t)product;
+        carry = product >> 32;
+    }
+}
+
+static void divideBig(Big* big, uint32_t divisor) {
+    uint64_t remainder = 0;
+    for (int i = BIG_LIMBS - 1; i >= 0; i--) {
+        uint64_t part = remainder << 32 | big->limbs[i];
+        big->limbs[i] = (uint32_t)(part / divisor);
+        remainder = part % divisor;
+    }
+}
+
+static int bitLength(Big* big) {
+    for (int i = BIG_LIMBS - 1; i >= 0; i--) {
+        if (big->limbs[i] != 0) return i * 32 + 32 - __builtin_clz(big->limbs[i]);
+    }
+    return 0;
+}
+
+// The 128 bits of big starting at bit shift. Bits below 0 read as zeroes, so a negative shift shifts left.
+static void extractBits(Big* big, int shift, uint64_t out[2]) {
+    out[0] = out[1] = 0;
+    for (int bit = 0; bit < 128; bit++) {
+        int from = bit + shift;
+        if (from < 0 || from >= BIG_LIMBS * 32) continue;
+        if (big->limbs[from / 32] >> (from % 32) & 1) out[bit / 64] |= (uint64_t)1 << (bit % 64);
+    }
+}
+
+static void computePow5() {
+    // 5^i, cut down (or padded out) to its top POW5_BITS bits
+    Big power = {{1}};
+    for (int i = 0; i < POW5_TABLE_SIZE; i++) {
+        extractBits(&power, bitLength(&power) - POW5_BITS, pow5Split[i]);
+        multiplyBig(&power, 5);
+    }
+
+    // floor(2^(bits of 5^i - 1 + POW5_BITS) / 5^i) + 1. Dividing 2^top by 5 over and over keeps floor(2^top / 5^i) exact.
+    int top = BIG_LIMBS * 32 - 1;
+    Big inverse = {{0}};
+    inverse.limbs[BIG_LIMBS - 1] = 1u << 31;
+    for (int i = 0; i < POW5_INV_TABLE_SIZE; i++) {
+        int bits = pow5Bits(i) - 1 + POW5_BITS;
+        uint64_t* entry = pow5InvSplit[i];
+        extractBits(&inverse, top - bits, entry);
+        if (++entry[0] == 0) entry[1]++;
+        divideBig(&inverse, 5);
+    }
+    pow5Ready = true;
+}
+
+static int pow5Factor(uint64_t value) {
+    int count = 0;
+    while (value % 5 == 0) {
+        value /= 5;
+        count++;
+    }
+    return count;
+}
+
+static bool multipleOfPow5(uint64_t value, int p) {
+    return pow5Factor(value) >= p;
+}
+
+static bool multipleOfPow2(uint64_t value, int p) {
+    return (value & (((uint64_t)1 << p) - 1)) == 0;
+}
+
+static uint64_t mulShift(uint64_t m, const uint64_t* mul, int shift) {
+    unsigned __int128 low = (unsigned __int128)m * mul[0];
+    unsigned __int128 high = (unsigned __int128)m * mul[1];
+    return (uint64_t)(((low >> 64) + high) >> (shift - 64));
+}
+
+// The shortest digits that read back as number (positive, finite and not 0), as *digits times 10^*exponent
+static void shortestDigits(double number, uint64_t* digits, int* exponent) {
+    if (!pow5Ready) computePow5();
+
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(double));
+    uint64_t mantissa = bits & (((uint64_t)1 << 52) - 1);
+    int biasedExponent = (int)(bits >> 52 & 0x7ff);
+
+    // number is m2 * 2^e2, and everything in (m2 - 1/2, m2 + 1/2) * 2^e2 rounds to it. Times 4 so the bounds are integers.
+    int e2;
+    uint64_t m2;
+    if (biasedExponent == 0) { // Subnormal
+        e2 = 1 - 1023 - 52 - 2;
+        m2 = mantissa;
+    } else {
+        e2 = biasedExponent - 1023 - 52 - 2;
+        m2 = (uint64_t)1 << 52 | mantissa;
+    }
+    bool acceptBounds = (m2 & 1) == 0; // Round half to even, so an even number owns the ends of its interval
+    uint64_t mv = 4 * m2;
+    int mmShift = mantissa != 0 || biasedExponent <= 1; // The gap below is half as big at a power of two
+
+    // vr, vp and vm are the number and its upper and lower bound, times 10^-e10
+    uint64_t vr, vp, vm;
+    int e10;
+    bool vmIsTrailingZeros = false;
+    bool vrIsTrailingZeros = false;
+    if (e2 >= 0) {
+        int q = log10Pow2(e2) - (e2 > 3);
+        e10 = q;
+        int k = POW5_BITS + pow5Bits(q) - 1;
+        int shift = -e2 + q + k;
+        vr = mulShift(4 * m2, pow5InvSplit[q], shift);
+        vp = mulShift(4 * m2 + 2, pow5InvSplit[q], shift);
+        vm = mulShift(4 * m2 - 1 - mmShift, pow5InvSplit[q], shift);
+        if (q <= 21) { // Only then can one of them be a multiple of 5^q, and so have lost nothing to the division
+            if (mv % 5 == 0) {
+                vrIsTrailingZeros = multipleOfPow5(mv, q);
+            } else if (acceptBounds) {
+                vmIsTrailingZeros = multipleOfPow5(mv - 1 - mmShift, q);
+            } else {
+                vp -= multipleOfPow5(mv + 2, q);
+            }
+        }
+    } else {
+        int q = log10Pow5(-e2) - (-e2 > 1);
+        e10 = q + e2;
+        int i = -e2 - q;
+        int k = pow5Bits(i) - POW5_BITS;
+        int shift = q - k;
+        vr = mulShift(4 * m2, pow5Split[i], shift);
+        vp = mulShift(4 * m2 + 2, pow5Split[i], shift);
+        vm = mulShift(4 * m2 - 1 - mmShift, pow5Split[i], shift);
+        if (q <= 1) {
+            vrIsTrailingZeros = true;
+            if (acceptBounds) {
+                vmIsTrailingZeros = mmShift == 1;
+            } else {
+                vp--;
+            }
+        } else if (q < 63) {
+            vrIsTrailingZeros = multipleOfPow2(mv, q);
+        }
+    }
+
+    // Take digits off while the bounds still differ above them
+    int removed = 0;
+    int lastRemovedDigit = 0;
+    uint64_t output;
+    if (vmIsTrailingZeros || vrIsTrailingZeros) { // Rare: exact ties are possible, so track them
+        while (vp / 10 > vm / 10) {
+            vmIsTrailingZeros &= vm % 10 == 0;
+            vrIsTrailingZeros &= lastRemovedDigit == 0;
+            lastRemovedDigit = (int)(vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        if (vmIsTrailingZeros) {
+            while (vm % 10 == 0) {
+                vrIsTrailingZeros &= lastRemovedDigit == 0;
+                lastRemovedDigit = (int)(vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                removed++;
+            }
+        }
+        if (vrIsTrailingZeros && lastRemovedDigit == 5 && vr % 2 == 0) lastRemovedDigit = 4; // Exactly halfway, round to even
+        output = vr + ((vr == vm && (!acceptBounds || !vmIsTrailingZeros)) || lastRemovedDigit >= 5);
+    } else {
+        bool roundUp = false;
+        while (vp / 10 > vm / 10) {
+            roundUp = vr % 10 >= 5;
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            removed++;
+        }
+        output = vr + (vr == vm || roundUp);
+    }
+
+    int exponent10 = e10 + removed;
+    while (output % 10 == 0) { // Rounding up can leave one
+        output /= 10;
+        exponent10++;
+    }
+    *digits = output;
+    *exponent = exponent10;
+}
+
+/*
+  Lays the digits out the way %.<p>g would, with p the larger of 15 and the number of digits.
+  That's what printing used to do, so only the digits that never needed to be there go away.
+*/
+static int layOutDigits(uint64_t digits, int exponent, bool negative, char* buffer) {
+    char text[20];
+    int count = 0;
+    do {
+        text[count++] = (char)('0' + digits % 10);
+        digits /= 10;
+    } while (digits != 0);
+    for (int i = 0; i < count / 2; i++) { // They came out backwards
+        char swap = text[i];
+        text[i] = text[count - 1 - i];
+        text[count - 1 - i] = swap;
+    }
+
+    int length = 0;
+    if (negative) buffer[length++] = '-';
+    int scientific = exponent + count - 1; // Exponent with one digit before the point
+    int precision = count > 15 ? count : 15;
+    if (scientific < -4 || scientific >= precision) {
+        buffer[length++] = text[0];
+        if (count > 1) {
+            buffer[length++] = '.';
+            memcpy(buffer + length, text + 1, count - 1);
+            length += count - 1;
+        }
+        length += sprintf(buffer + length, "e%c%02d", scientific < 0 ? '-' : '+', scientific < 0 ? -scientific : scientific);
+    } else if (scientific < 0) {
+        buffer[length++] = '0';
+        buffer[length++] = '.';
+        for (int i = -1; i > scientific; i--) buffer[length++] = '0';
+        memcpy(buffer + length, text, count);
+        length += count;
+    } else {
+        int whole = scientific + 1; // Digits before the point
+        for (int i = 0; i < whole; i++) buffer[length++] = i < count ? text[i] : '0';
+        if (count > whole) {
+            buffer[length++] = '.';
+            memcpy(buffer + length, text + whole, count - whole);
+            length += count - whole;
+        }
+    }
+    buffer[length] = '\0';
+    return length;
+}
+
+#endif
+
+/*
+  Writes the shortest decimal string that reads back as exactly the same double, and returns its length.
+  Most numbers in Lox programs are small integers, so those skip straight to a digit loop.
+*/
+int formatNumber(double number, char* buffer) {
+    if (isnan(number)) return sprintf(buffer, "nan");
+    if (isinf(number)) return sprintf(buffer, number > 0 ? "inf" : "-inf");
+
+    // Integers below 1e15 print the same as %.15g would, just without the formatting machinery
+    if (number == floor(number) && fabs(number) < 1e15) {
+        bool negative = signbit(number) != 0; // Catches -0 too
+        return formatInteger((uint64_t)fabs(number), negative, buffer);
+    }
+
+#ifdef __SIZEOF_INT128__
+    uint64_t digits;
+    int exponent;
+    shortestDigits(fabs(number), &digits, &exponent);
+    return layOutDigits(digits, exponent, number < 0, buffer);
+#else
+    // No 128 bit multiply for shortestDigits(). Any double survives 17 digits, and any decimal with 15 or fewer survives the
+    // trip the other way, so the first of these that round-trips is the shortest, as long as that's 15 digits or more.
+    int length = 0;
+    for (int precision = 15; precision <= 17; precision++) {
+        length = snprintf(buffer, NUMBER_BUFFER_SIZE, "%.*g", precision, number);
+        if (strtod(buffer, NULL) == number) break;
+    }
+    return length;
+#endif
+}
+
+// Written with the IS_ macros rather than a switch on the type, so it works on compressed Values too
 void printValue(Value value) {
-    switch (value.type) {
-        case VAL_BOOL:
-            printf(AS_BOOL(value) ? "true" : "false");
-            break;
-        case VAL_NIL: printf("nil"); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-        case VAL_OBJ: printObject(value); break;
+    if (IS_NUMBER(value)) {
+        char buffer[NUMBER_BUFFER_SIZE];
+        int length = formatNumber(AS_NUMBER(value), buffer);
+        writeOutput(&vm.out, buffer, length);
+    } else if (IS_OBJ(value)) {
+        printObject(value);
+    } else if (IS_BOOL(value)) {
+        writeString(&vm.out, AS_BOOL(value) ? "true" : "false");
+    } else {
+        writeOutput(&vm.out, "nil", 3);
     }
 }
 
 bool valuesEqual(Value a, Value b) {
-    if (a.type != b.type) return false;
-    switch (a.type) {
-        case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
-        case VAL_NIL:    return true;
-        case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
-        case VAL_OBJ: {
-            ObjString* aString = AS_STRING(a);
-            ObjString* bString = AS_STRING(b);
-            return aString->length == bString->length &&
-                memcmp(aString->chars, bString->chars, aString->length) == 0;
-        }
-        default:         return false; // Unreachable
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b); // Not a bit compare, NaN isn't equal to itself
+    if (IS_OBJ(a) && IS_OBJ(b)) {
+        ObjString* aString = AS_STRING(a);
+        ObjString* bString = AS_STRING(b);
+        if (aString == bString) return true; // Always the case for two shared strings with the same chars
+        return aString->length == bString->length &&
+            memcmp(aString->chars, bString->chars, aString->length) == 0;
     }
+    if (IS_BOOL(a) && IS_BOOL(b)) return AS_BOOL(a) == AS_BOOL(b);
+    return IS_NIL(a) && IS_NIL(b);
 }
\ No newline at end of file
@@ -6,6 +6,67 @@
 typedef struct Obj Obj; 
 typedef struct ObjString ObjString;
 
+#ifdef OBJECT_COMPRESSION
+
+#include <string.h>
+
+/*
+  Compressed mode. A Value is a single 64-bit word: numbers are stored as themselves, and everything else hides in the
+  quiet NaN space no arithmetic ever produces. Every object lives in one reserved region (see memory.c), so an object
+  reference only needs to be a 32-bit offset into it. That halves the stack, constant pools and the object table.
+*/
+typedef uint64_t Value;
+typedef uint32_t ObjRef; // Offset of an object in objectRegion. 0 is never an object.
+
+extern uint8_t* objectRegion;
+
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN     ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL   1
+#define TAG_FALSE 2
+#define TAG_TRUE  3
+
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL  ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define REF_TO_OBJ(ref)    ((Obj*)(objectRegion + (ref)))
+#define OBJ_TO_REF(object) ((ObjRef)((uint8_t*)(object) - objectRegion))
+
+#define IS_BOOL(value)    (((value) | 1) == TRUE_VAL) // true and false only differ in the lowest bit
+#define IS_NIL(value)     ((value) == NIL_VAL)
+#define IS_NUMBER(value)  (((value) & QNAN) != QNAN)
+#define IS_OBJ(value)     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_OBJ(value)     REF_TO_OBJ((ObjRef)(value))
+#define AS_BOOL(value)    ((value) == TRUE_VAL)
+#define AS_NUMBER(value)  valueToNumber(value)
+
+#define OBJ_VAL(object)   ((Value)(SIGN_BIT | QNAN | OBJ_TO_REF(object)))
+#define BOOL_VAL(value)   ((value) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL           ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define NUMBER_VAL(value) numberToValue(value)
+
+// memcpy is how C spells "reinterpret these bits", compilers turn it into a register move
+static inline double valueToNumber(Value value) {
+    double number;
+    memcpy(&number, &value, sizeof(Value));
+    return number;
+}
+
+static inline Value numberToValue(double number) {
+    Value value;
+    memcpy(&value, &number, sizeof(double));
+    return value;
+}
+
+#else
+
+typedef Obj* ObjRef; // Object references are plain pointers
+
+#define REF_TO_OBJ(ref)    (ref)
+#define OBJ_TO_REF(object) ((Obj*)(object))
+
 typedef enum {
     VAL_BOOL,
     VAL_NIL,
@@ -39,6 +100,10 @@ typedef struct {
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 
+#endif
+
+#define NUMBER_BUFFER_SIZE 32 // Big enough for the longest number formatNumber() can write, plus the null terminator
+
 typedef struct {
     int capacity;
     int count;
@@ -49,6 +114,7 @@ bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray* array);
 void writeValueArray(ValueArray* array, Value value);
 void freeValueArray(ValueArray* array);
+int formatNumber(double number, char* buffer);
 void printValue(Value value);
 
 #endif
\ No newline at end of file
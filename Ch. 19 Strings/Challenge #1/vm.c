@@ -1,41 +1,80 @@
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "heapprofile.h"
+#include "jit.h"
+#include "memo.h"
 #include "object.h"
 #include "memory.h"
+#include "profile.h"
+#include "sampler.h"
 #include "vm.h"
 
 VM vm;
 
 static void resetStack() {
-    vm.stackTop = vm.stack;
+    vm.stackTop = vm.stack + 1; // Skip the floor slot
 }
 
-static void runtimeError(const char* format, ...) {
+void runtimeError(const char* format, ...) {
+    flushOutput(&vm.out); // So the error shows up after everything printed before it
+
     va_list args;
     va_start(args, format);
-    vfprintf(stderr, format, args);
+    vfprintf(vm.err, format, args);
     va_end(args);
-    fputs("\n", stderr);
+    fputs("\n", vm.err);
 
     // Current instruction index minus 1, because interpreter advances past an instruction before execution
     size_t instruction = vm.ip - vm.chunk->code - 1;
     int line = vm.chunk->lines[instruction];
-    fprintf(stderr, "[line %d] in script\n", line);
+    fprintf(vm.err, "[line %d] in script\n", line);
     resetStack();
 }
 
 void initVM() {
     resetStack();
-    vm.objects = NULL;
+    initObjectTable(&vm.objects);
+    initOutput(&vm.out, stdout);
+    vm.err = stderr;
+    vm.inputs = NULL;
+    vm.result = NULL;
+    vm.traceExecution = false;
+    vm.printCode = false;
+    vm.profileExecution = false;
+    vm.sampleExecution = false;
+    vm.profileHeap = false;
+    vm.registerMachine = false;
+    vm.jitEnabled = false;
+    vm.jitThreshold = JIT_THRESHOLD;
+    vm.phase = PHASE_IDLE;
+    vm.sharedHeap = false;
+    vm.bytesAllocated = 0;
+    vm.peakBytes = 0;
+    vm.heapCeiling = SIZE_MAX;
+    vm.limits = (Limits){0};
+    vm.usage = (Usage){0};
+    vm.timePhases = false;
+    vm.phaseStats = (PhaseStats){0};
+    vm.memoize = false;
+    vm.internLiterals = true;
 }
 
 void freeVM() {
+    flushOutput(&vm.out);
+    if (vm.profileExecution) dumpProfile();
+    if (vm.sampleExecution) stopSampler();
+    if (vm.profileHeap) dumpHeapProfile(); // Before the objects go, so it can count what's still live
     freeObjects();
+    if (vm.timePhases) stopCounters();
+    stopMemo();
 }
 
 void push(Value value) {
@@ -48,20 +87,15 @@ Value pop() {
     return *vm.stackTop;
 }
 
-// Returns a Value from the stack without popping it
-static Value peek(int distance) {
-    // stackTop is a pointer to the top of the stack, so this is doing pointer math to find values
-    return vm.stackTop[-1 - distance];
-}
-
-static bool isFalsey(Value value) {
+bool isFalsey(Value value) {
+#ifdef OBJECT_COMPRESSION
+    return value == NIL_VAL || value == FALSE_VAL; // Both are single words, so skip the tag checks
+#else
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+#endif
 }
 
-static void concatenate() {
-    ObjString* b = AS_STRING(pop());
-    ObjString* a = AS_STRING(pop());
-
+ObjString* concatenate(ObjString* a, ObjString* b) {
     // Calculate length of new string
     int length = a->length + b->length;
 
@@ -75,116 +109,434 @@ static void concatenate() {
     // Add null terminator
     chars[length] = '\0';
 
-    // Wrap the string into an ObjString, then push it onto the stack
-    ObjString* result = takeString(chars, length);
-    push(OBJ_VAL(result));
+    // Wrap the string into an ObjString
+    return takeString(chars, length);
+}
+
+// Prints the stack and the instruction about to execute. Only called by runTraced().
+static void traceInstruction() {
+    writeString(&vm.out, "          ");
+    for (Value* slot = vm.stack + 1; slot < vm.stackTop; slot++) {
+        writeOutput(&vm.out, "[ ", 2);
+        printValue(*slot);
+        writeOutput(&vm.out, " ]", 2);
+    }
+    writeOutput(&vm.out, "\n", 1);
+    disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+}
+
+// Copies of the same loop: run() has no debugging code at all, the others are picked at runtime when tracing or profiling is on
+#define RUN_FUNCTION run
+#define BEFORE_INSTRUCTION()
+#include "run.inc"
+
+#define RUN_FUNCTION runTraced
+#define BEFORE_INSTRUCTION() SYNC(), traceInstruction()
+#include "run.inc"
+
+#define RUN_FUNCTION runProfiled
+#define BEFORE_INSTRUCTION() profileInstruction(vm.chunk, ip)
+#include "run.inc"
+
+#define RUN_FUNCTION runSampled
+#define BEFORE_INSTRUCTION() vm.sampleIp = ip
+#include "run.inc"
+
+/*
+  Metering for runMetered(), the loop used when vm.limits has anything set. Instructions are counted down in batches,
+  and the limits are only looked at when a batch runs out, so each instruction just pays for a decrement and a compare
+  against heapCeiling (which reallocate() can push us past at any allocation).
+*/
+#define METER_BATCH 1024
+
+static long meterBatch;     // Size of the current batch
+static long meterCountdown; // Instructions left in it
+static double deadline;     // now() time the current call has to finish by
+
+static double now() {
+    struct timespec time;
+    timespec_get(&time, TIME_UTC);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+bool hasLimits() {
+    return vm.limits.instructions > 0 || vm.limits.heapBytes > 0 || vm.limits.seconds > 0;
+}
+
+static void startBatch() {
+    meterBatch = METER_BATCH;
+    if (vm.limits.instructions > 0) {
+        long remaining = vm.limits.instructions - vm.usage.instructions;
+        if (remaining < meterBatch) meterBatch = remaining + 1; // So the instruction after the last allowed one trips the limit
+    }
+    meterCountdown = meterBatch;
+}
+
+// Like runtimeError(), except the instruction at vm.ip hasn't started yet
+static void limitError(const char* message) {
+    flushOutput(&vm.out);
+    fprintf(vm.err, "%s\n[line %d] in script\n", message, vm.chunk->lines[vm.ip - vm.chunk->code]);
+    resetStack();
+}
+
+// runMetered()'s slow path. The instruction at vm.ip has been counted, but it only runs if this returns INTERPRET_OK.
+static InterpretResult checkLimits() {
+    vm.usage.instructions += meterBatch - meterCountdown;
+    meterBatch = meterCountdown = 0;
+
+    InterpretResult result = INTERPRET_OK;
+    if (vm.bytesAllocated > vm.heapCeiling) {
+        limitError("Heap limit exceeded.");
+        result = INTERPRET_OUT_OF_MEMORY;
+    } else if (vm.limits.instructions > 0 && vm.usage.instructions > vm.limits.instructions) {
+        limitError("Instruction limit exceeded.");
+        result = INTERPRET_OUT_OF_FUEL;
+    } else if (vm.limits.seconds > 0 && now() > deadline) {
+        limitError("Time limit exceeded.");
+        result = INTERPRET_TIMEOUT;
+    }
+
+    if (result != INTERPRET_OK) {
+        vm.usage.instructions--; // It never ran
+        return result;
+    }
+    startBatch();
+    return INTERPRET_OK;
 }
 
-static InterpretResult run() {
-#define READ_BYTE() (*vm.ip++) // The IP (instruction pointer) always points to the next byte of code.
-#define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()]) // The bytecode array stores the index of a Value in the constant pool.
+#define RUN_FUNCTION runMetered
+#define BEFORE_INSTRUCTION() \
+    if (--meterCountdown == 0 || vm.bytesAllocated > vm.heapCeiling) { \
+        SYNC(); \
+        InterpretResult trap = checkLimits(); \
+        if (trap != INTERPRET_OK) return trap; \
+    }
+#include "run.inc"
+
+// runSlice() stops before the instruction after its budget runs out, or once the heap is past heapCeiling, so it can pick
+// up there later. The scheduler decides what that means for vm.limits.
+static long sliceBudget;
+
+#define RUN_FUNCTION runSlice
+#define BEFORE_INSTRUCTION() \
+    if (sliceBudget-- == 0 || vm.bytesAllocated > vm.heapCeiling) { \
+        SYNC(); \
+        return INTERPRET_YIELD; \
+    }
+#include "run.inc"
+
+/*
+  The register machine's loop. Registers live in the stack array, since the stack machine isn't using it.
+  Source operands are RK bytes (see chunk.h), so constants get read straight out of the pool.
+*/
+static InterpretResult runRegisters() {
+    uint8_t* ip = vm.ip;
+    Value* constants = vm.chunk->constants.values;
+    Value* registers = vm.stack + 1;
+
+#define READ_BYTE() (*ip++)
+#define RK(operand) ((operand) >= RK_CONSTANT ? constants[(operand) - RK_CONSTANT] : registers[operand])
 #define BINARY_OP(valueType, op) \
     do { \
-        /* Binary operations are pushed onto the stack in this order: operator, left operand, right operand */ \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
+        uint8_t dst = READ_BYTE(); \
+        uint8_t operandA = READ_BYTE(); \
+        uint8_t operandB = READ_BYTE(); \
+        Value a = RK(operandA); \
+        Value b = RK(operandB); \
+        if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+            vm.ip = ip; \
             runtimeError("Operands must be numbers."); \
+            return INTERPRET_RUNTIME_ERROR; \
         } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(valueType(a op b)); \
+        registers[dst] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
     } while (false)
 
     for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
-#endif
         uint8_t instruction;
         switch (instruction = READ_BYTE()) {
-            case OP_CONSTANT: {
-                Value constant = READ_CONSTANT();
-                push(constant);
+            case OP_LOAD_R: {
+                uint8_t dst = READ_BYTE();
+                registers[dst] = constants[READ_BYTE()];
                 break;
             }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
+            case OP_EQUAL_R: {
+                uint8_t dst = READ_BYTE();
+                uint8_t operandA = READ_BYTE();
+                uint8_t operandB = READ_BYTE();
+                registers[dst] = BOOL_VAL(valuesEqual(RK(operandA), RK(operandB)));
                 break;
             }
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
-            case OP_ADD: {
-                // String concatenation
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                // Number addition
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
+            case OP_GREATER_R:  BINARY_OP(BOOL_VAL, >); break;
+            case OP_LESS_R:     BINARY_OP(BOOL_VAL, <); break;
+            case OP_ADD_R: {
+                uint8_t dst = READ_BYTE();
+                uint8_t operandA = READ_BYTE();
+                uint8_t operandB = READ_BYTE();
+                Value a = RK(operandA);
+                Value b = RK(operandB);
+                if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    registers[dst] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+                } else if (IS_STRING(a) && IS_STRING(b)) {
+                    vm.ip = ip; // Allocates
+                    registers[dst] = OBJ_VAL(concatenate(AS_STRING(a), AS_STRING(b)));
                 } else {
+                    vm.ip = ip;
                     runtimeError("Operands must be two numbers or two strings.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 break;
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT:
-                // Pop the bool, operate on it, then push it
-                push(BOOL_VAL(isFalsey(pop())));
+            case OP_SUBTRACT_R: BINARY_OP(NUMBER_VAL, -); break;
+            case OP_MULTIPLY_R: BINARY_OP(NUMBER_VAL, *); break;
+            case OP_DIVIDE_R:   BINARY_OP(NUMBER_VAL, /); break;
+            case OP_NOT_R: {
+                uint8_t dst = READ_BYTE();
+                uint8_t operand = READ_BYTE();
+                registers[dst] = BOOL_VAL(isFalsey(RK(operand)));
                 break;
-            case OP_NEGATE: 
-                // Check if operand is a number  
-                if (!IS_NUMBER(peek(0))) {
+            }
+            case OP_NEGATE_R: {
+                uint8_t dst = READ_BYTE();
+                uint8_t operand = READ_BYTE();
+                Value value = RK(operand);
+                if (!IS_NUMBER(value)) {
+                    vm.ip = ip;
                     runtimeError("Operand must be a number.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-
-                // Unwrap the Value, negate it, and then wrap it back up
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-            case OP_RETURN: {
-                printValue(pop());
-                printf("\n");
+                registers[dst] = NUMBER_VAL(-AS_NUMBER(value));
+                break;
+            }
+            case OP_RETURN_R: {
+                uint8_t operand = READ_BYTE();
+                vm.ip = ip;
+                if (vm.result != NULL) {
+                    *vm.result = RK(operand);
+                    return INTERPRET_OK;
+                }
+                printValue(RK(operand));
+                writeOutput(&vm.out, "\n", 1);
                 return INTERPRET_OK;
             }
         }
     }
 
 #undef READ_BYTE
-#undef READ_CONSTANT
+#undef RK
 #undef BINARY_OP
 }
 
-// Prepare a chunk in the VM for execution
-InterpretResult interpret(const char* source) {
+// Runs a compiled chunk from the start with whichever loop the VM's settings ask for. The chunk still belongs to the caller.
+InterpretResult runChunk(Chunk* chunk) {
+    vm.chunk = chunk;
+    vm.ip = vm.chunk->code; // VM's instruction pointer now points to the newest instruction
+
+    vm.sampleIp = vm.ip;
+    atomic_signal_fence(memory_order_release); // The sampler can't see PHASE_RUN until it can see this chunk and ip too
+    vm.phase = PHASE_RUN;
+    InterpretResult result; // Execute!
+    JitCode jit;
+    if (vm.jitEnabled && chunk->count >= vm.jitThreshold && !vm.registerMachine && !hasLimits() &&
+        !vm.traceExecution && !vm.profileExecution && !vm.sampleExecution && compileJit(chunk, &jit)) {
+        result = jit.function(vm.stackTop);
+        freeJit(&jit);
+    } else if (vm.registerMachine) {
+        result = runRegisters(); // Register code only runs here, so none of the debugging loops apply
+    } else if (hasLimits()) {
+        startBatch();
+        result = runMetered(); // Limits win over the debugging loops
+        vm.usage.instructions += meterBatch - meterCountdown;
+    } else if (vm.traceExecution) {
+        result = runTraced();
+    } else if (vm.profileExecution) {
+        result = runProfiled();
+        endProfileRun();
+    } else if (vm.sampleExecution) {
+        result = runSampled();
+    } else {
+        result = run();
+    }
+    vm.phase = PHASE_IDLE;
+    atomic_signal_fence(memory_order_release); // Nor whatever the caller does to the chunk next, before this
+    return result;
+}
+
+// Runs a batch formula on one row with the plain loop, and hands back its value instead of printing it
+InterpretResult runRow(Chunk* chunk, Value* inputs, Value* result) {
+    vm.chunk = chunk;
+    vm.ip = chunk->code;
+    vm.inputs = inputs;
+    vm.result = result;
+    InterpretResult status = run();
+    vm.inputs = NULL;
+    vm.result = NULL;
+    return status;
+}
+
+static double phaseMark; // When the phase being timed started
+static uint64_t phaseMarkCounters[COUNTER_COUNT];
+
+void startPhaseTiming() {
+    vm.timePhases = true;
+    startCounters(); // Wall time still works without them
+}
+
+static void resetPhaseMark() {
+    phaseMark = now();
+    readCounters(phaseMarkCounters);
+}
+
+// Charges everything since the last mark to phase. Only called while vm.timePhases is on.
+static void markPhase(Phase phase) {
+    double time = now();
+    uint64_t counters[COUNTER_COUNT];
+    readCounters(counters);
+
+    PhaseCost* cost = &vm.phaseStats.phases[phase];
+    cost->seconds += time - phaseMark;
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        cost->counters[i] += counters[i] - phaseMarkCounters[i];
+        phaseMarkCounters[i] = counters[i];
+    }
+    phaseMark = time;
+}
+
+// Folds the call that just finished into vm.usage
+static void recordUsage(size_t heapBefore, size_t peakBefore, double start) {
+    vm.usage.heapBytes = vm.peakBytes - heapBefore;
+    vm.usage.seconds = now() - start;
+    if (peakBefore > vm.peakBytes) vm.peakBytes = peakBefore;
+
+    if (vm.usage.instructions > vm.usage.peakInstructions) vm.usage.peakInstructions = vm.usage.instructions;
+    if (vm.usage.heapBytes > vm.usage.peakHeapBytes) vm.usage.peakHeapBytes = vm.usage.heapBytes;
+    if (vm.usage.seconds > vm.usage.peakSeconds) vm.usage.peakSeconds = vm.usage.seconds;
+}
+
+// Prepare a chunk in the VM for execution. If file isn't NULL, source is its text, and string constants get to point into it.
+static InterpretResult compileAndRun(const char* source, Source* file) {
+    // Limits and usage are per call. There's no GC yet, so the heap limit is on growth, not on everything that's live.
+    size_t heapBefore = vm.bytesAllocated;
+    size_t peakBefore = vm.peakBytes;
+    vm.peakBytes = vm.bytesAllocated; // Measure this call's peak on its own, recordUsage() puts the overall one back
+    vm.heapCeiling = vm.limits.heapBytes > 0 ? heapBefore + vm.limits.heapBytes : SIZE_MAX;
+    vm.usage.instructions = 0;
+    double start = now();
+    deadline = start + vm.limits.seconds;
+
+    // Anything watching execution (or limiting it) has to see the program actually run
+    bool memoize = vm.memoize && !hasLimits() && !vm.traceExecution && !vm.printCode && !vm.profileExecution &&
+                   !vm.sampleExecution && !vm.timePhases;
+    Value remembered;
+    if (memoize && recallSource(source, &remembered)) {
+        printValue(remembered);
+        writeOutput(&vm.out, "\n", 1);
+        recordUsage(heapBefore, peakBefore, start);
+        return INTERPRET_OK;
+    }
+
     Chunk chunk;
     initChunk(&chunk);
 
-    if (!compile(source, &chunk)) { // If theres a compilation error
+    if (file != NULL) {
+        retainSource(file);
+        chunk.source = file;
+    }
+
+    if (vm.timePhases) {
+        vm.phaseStats.calls++;
+        resetPhaseMark();
+        prescan(source);
+        markPhase(PHASE_SCAN);
+    }
+
+    vm.phase = PHASE_COMPILE;
+    bool compiled = compile(source, &chunk);
+    if (vm.timePhases) markPhase(PHASE_COMPILE);
+    if (!compiled) { // If theres a compilation error
+        vm.phase = PHASE_IDLE;
         freeChunk(&chunk);
+        recordUsage(heapBefore, peakBefore, start);
         return INTERPRET_COMPILE_ERROR;
     }
+    if (vm.bytesAllocated > vm.heapCeiling) { // Constants count too
+        vm.phase = PHASE_IDLE;
+        freeChunk(&chunk);
+        flushOutput(&vm.out);
+        fprintf(vm.err, "Heap limit exceeded while compiling.\n");
+        recordUsage(heapBefore, peakBefore, start);
+        return INTERPRET_OUT_OF_MEMORY;
+    }
 
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code; // VM's instruction pointer now points to the newest instruction
+    if (memoize && recallCode(source, &chunk, &remembered)) {
+        printValue(remembered);
+        writeOutput(&vm.out, "\n", 1);
+        freeChunk(&chunk);
+        recordUsage(heapBefore, peakBefore, start);
+        return INTERPRET_OK;
+    }
+
+    if (memoize) vm.result = &remembered; // Returned instead of printed, so it can be remembered first
+    InterpretResult result = runChunk(&chunk);
+    if (vm.timePhases) markPhase(PHASE_RUN);
+    if (memoize) {
+        vm.result = NULL;
+        if (result == INTERPRET_OK) {
+            rememberResult(source, &chunk, remembered);
+            printValue(remembered);
+            writeOutput(&vm.out, "\n", 1);
+        }
+    }
 
-    InterpretResult result = run(); // Execute!
+    if (vm.sampleExecution) resolveSamples(&chunk); // Samples only know their offset, so map them to lines while we still have the chunk
 
     freeChunk(&chunk); // Free chunk after its done executing
+    recordUsage(heapBefore, peakBefore, start);
+    if (vm.profileHeap) checkHeapProfileSignal();
+    if (vm.timePhases) markPhase(PHASE_IDLE);
     return result;
 }
 
+/*
+  Runs the chunk already loaded into the VM (vm.chunk, vm.ip and the stack) for at most *budget instructions, and takes
+  what it used off *budget. Returns INTERPRET_YIELD if the chunk isn't done, with vm.ip and the stack ready to resume
+  from, even after the scheduler has swapped other tasks through in between. Also yields early if the heap goes past
+  vm.heapCeiling, so checkTaskLimits() gets to see it.
+*/
+InterpretResult resume(long* budget) {
+    sliceBudget = *budget;
+    InterpretResult result = runSlice();
+    *budget = sliceBudget < 0 ? 0 : sliceBudget;
+    return result;
+}
+
+/*
+  checkLimits() for the scheduler, which meters a task between its slices. instructions, heapBytes and seconds are what
+  the task in the VM has used so far, and it wants to run the instruction at vm.ip next. Each task gets the whole of
+  vm.limits, like a call to interpret() would. Reports the limit it's over the same way runMetered() does.
+*/
+InterpretResult checkTaskLimits(long instructions, size_t heapBytes, double seconds) {
+    if (vm.limits.heapBytes > 0 && heapBytes > vm.limits.heapBytes) {
+        limitError("Heap limit exceeded.");
+        return INTERPRET_OUT_OF_MEMORY;
+    }
+    if (vm.limits.instructions > 0 && instructions >= vm.limits.instructions) {
+        limitError("Instruction limit exceeded.");
+        return INTERPRET_OUT_OF_FUEL;
+    }
+    if (vm.limits.seconds > 0 && seconds > vm.limits.seconds) {
+        limitError("Time limit exceeded.");
+        return INTERPRET_TIMEOUT;
+    }
+    return INTERPRET_OK;
+}
+
+InterpretResult interpret(const char* source) {
+    return compileAndRun(source, NULL);
+}
+
+InterpretResult interpretSource(Source* source) {
+    return compileAndRun(source->chars, source);
+}
+
 
 
@@ -2,30 +2,110 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "counters.h"
+#include "object.h"
+#include "output.h"
 #include "value.h"
 
 #define STACK_MAX 256
 
+typedef enum {
+    PHASE_IDLE,    // Not inside interpret()
+    PHASE_SCAN,
+    PHASE_COMPILE,
+    PHASE_RUN,
+    PHASE_COUNT
+} Phase; // What interpret() is busy with. The sampling profiler reads this from its signal handler.
+
+// Per interpret() call limits, for running code we don't trust. 0 means no limit.
+typedef struct {
+    long instructions; // Instructions one call may execute
+    size_t heapBytes;  // How much one call may grow the heap by
+    double seconds;    // Wall clock time one call may take
+} Limits;
+
+// What interpret() calls have used, for sizing the limits. Instructions are only counted while a limit is set.
+typedef struct {
+    long instructions; // Last call
+    size_t heapBytes;
+    double seconds;
+    long peakInstructions; // Most of each any call has used
+    size_t peakHeapBytes;
+    double peakSeconds;
+} Usage;
+
+typedef struct {
+    double seconds;
+    uint64_t counters[COUNTER_COUNT]; // Stay 0 for counters that aren't available
+} PhaseCost;
+
+// Where interpret() calls have spent their time since vm.timePhases went on, indexed by Phase.
+// PHASE_IDLE collects the bits between the others, like freeing chunks.
+typedef struct {
+    PhaseCost phases[PHASE_COUNT];
+    long calls;
+} PhaseStats;
+
 typedef struct {
     Chunk* chunk;
     uint8_t* ip; // Instruction Pointer
-    Value stack[STACK_MAX];
+    Value stack[STACK_MAX + 1]; // stack[0] is the floor slot. It's never part of the stack, run() just spills its cached top into it when the stack is empty.
     Value* stackTop; // Always points to the element after the element last pushed onto the stack
-    Obj* objects;
+    ObjectTable objects; // Everything allocated, for freeObjects() and heap statistics
+    bool traceExecution; // Print the stack and each instruction as it runs
+    bool printCode;      // Disassemble each chunk after compiling it
+    bool profileExecution; // Count opcodes, opcode pairs and lines, reported by freeVM()
+    bool jitEnabled;       // Compile chunks of at least jitThreshold bytes to native code when the platform allows it
+    int jitThreshold;
+    bool registerMachine;  // Compile to register machine code and run it with runRegisters() instead of run()
+    bool profileHeap;      // Sample allocations by site, reported by freeVM() and on SIGUSR1
+    bool sampleExecution;  // The SIGPROF sampler is running, so run() has to keep sampleIp up to date
+    volatile Phase phase;
+    uint8_t* volatile sampleIp; // Copy of ip for the sampler's signal handler, which can't trust vm.ip to be in memory
+    bool sharedHeap;       // Another thread allocates too (see shareHeap()), so the allocator locks
+    size_t bytesAllocated; // Live heap bytes, kept exact by reallocate()
+    size_t peakBytes;      // Most bytesAllocated has ever been
+    size_t heapCeiling;    // bytesAllocated past this trips the heap limit. SIZE_MAX when there isn't one.
+    Limits limits;
+    Usage usage;
+    bool timePhases;       // Fill phaseStats. Scans each source up front, so scanning and compiling can be timed apart.
+    PhaseStats phaseStats;
+    bool memoize;          // Remember what pure programs evaluated to, and skip running them again (see memo.h)
+    bool internLiterals;   // Literals go in the intern table (see intern.h). Off while they'd die with their request, since shared strings never do.
+    OutputBuffer out; // Everything the VM prints goes through here. Flushed when full, before errors, and before waiting on input.
+    FILE* err;        // Compile and runtime errors. stderr, unless someone (like the server) wants them back.
+    Value* inputs;    // The row OP_INPUT reads from, while runRow() runs a batch formula
+    Value* result;    // When set, OP_RETURN stores its value here instead of printing it
 } VM;
 
 typedef enum {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
-    INTERPRET_RUNTIME_ERROR
+    INTERPRET_RUNTIME_ERROR,
+    INTERPRET_OUT_OF_FUEL,   // Hit limits.instructions
+    INTERPRET_OUT_OF_MEMORY, // Hit limits.heapBytes
+    INTERPRET_TIMEOUT,       // Hit limits.seconds
+    INTERPRET_YIELD          // resume() ran out of instructions before the chunk finished
 } InterpretResult;
 
 extern VM vm;
 
 void initVM();
 void freeVM();
+bool hasLimits();
+void startPhaseTiming();
 InterpretResult interpret(const char* source);
+InterpretResult interpretSource(Source* source);
+InterpretResult runChunk(Chunk* chunk);
+InterpretResult runRow(Chunk* chunk, Value* inputs, Value* result);
+InterpretResult resume(long* budget);
+InterpretResult checkTaskLimits(long instructions, size_t heapBytes, double seconds);
 void push(Value value);
 Value pop();
 
+// Shared with the JIT's helpers
+void runtimeError(const char* format, ...);
+bool isFalsey(Value value);
+ObjString* concatenate(ObjString* a, ObjString* b);
+
 #endif
\ No newline at end of file